@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+# Benchmark: prompt latency with a huge index.
+#
+# Usage: bench/index.sh [number-of-entries] [iterations]
+#
+# Generates a throw-away repo whose index holds the requested number of
+# entries (1M by default) and a commit of them, and times the status
+# part of the prompt with the index written in each format: v2 and v4
+# (path-prefix compression), with and without the EOIE/IEOT extensions
+# git writes for multi-threaded readers (index.threads). The files are
+# not checked out, so the working-directory check stops at the first
+# entry and the index load dominates.
+
+set -euo pipefail
+
+ENTRIES=${1:-1000000}
+ITERATIONS=${2:-20}
+GENERATE_PROMPT="$(cd "$(dirname "$0")/.." && pwd)/bin/generate-prompt"
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+cd "$WORKDIR"
+
+git init --quiet --initial-branch=main repo
+cd repo
+git config user.email "bench@test.com"
+git config user.name "Bench Person"
+
+echo "Generating $ENTRIES index entries..."
+blob=$(git hash-object -w --stdin < /dev/null)
+awk -v blob="$blob" -v n="$ENTRIES" \
+  'BEGIN { for (i = 0; i < n; i++) printf "100644 %s\tsrc/module-%04d/file-%07d.c\n", blob, i / 1000, i }' |
+  git update-index --index-info
+git commit --quiet -m 'Initial commit'
+
+# writes the index in a format; IEOT blocks are only written for more
+# than one thread
+write_index() {
+  git config index.version "$1"
+  git config index.threads "$2"
+  git update-index --index-version "$1" --force-write-index
+}
+
+export GP_GIT_PROMPT='\pL'
+export GP_SINGLE_FLIGHT_WAIT_MS=0
+
+bench() {
+  local label="$1"
+  local start end
+  start=$(date +%s%N)
+  for ((i = 0; i < ITERATIONS; i++)); do
+    "$GENERATE_PROMPT" > /dev/null
+  done
+  end=$(date +%s%N)
+  awk -v label="$label" -v ns=$((end - start)) -v n="$ITERATIONS" \
+    -v size="$(du -h .git/index | cut -f1)" \
+    'BEGIN { printf "%-36s %6s %8.2f ms/prompt\n", label, size, ns / n / 1000000 }'
+}
+
+write_index 2 1; bench "index v2"
+write_index 2 8; bench "index v2, IEOT (8 blocks)"
+write_index 4 1; bench "index v4"
+write_index 4 8; bench "index v4, IEOT (8 blocks)"
+
+# a staged change invalidates the cache tree, so the staged state comes
+# from libgit2's diff, which loads the index again
+echo "100644 $blob	src/staged.c" | git update-index --index-info
+bench "index v4, IEOT, something staged"
@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+# Benchmark: prompt latency in a repository with a huge packed-refs.
+#
+# Usage: bench/refs.sh [number-of-refs] [iterations]
+#
+# Generates a throw-away repo whose packed-refs holds the requested
+# number of remote-tracking refs (500k by default), plus the
+# refs/remotes/origin/main ref the prompt looks up, and times a few
+# prompt patterns in it.
+
+set -euo pipefail
+
+REFS=${1:-500000}
+ITERATIONS=${2:-50}
+GENERATE_PROMPT="$(cd "$(dirname "$0")/.." && pwd)/bin/generate-prompt"
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+cd "$WORKDIR"
+
+git init --quiet --initial-branch=main repo
+cd repo
+git config user.email "bench@test.com"
+git config user.name "Bench Person"
+echo "some text" > newfile
+git add newfile
+git commit --quiet -m 'Initial commit'
+oid=$(git rev-parse HEAD)
+
+echo "Generating $REFS refs..."
+{
+  echo "# pack-refs with: peeled fully-peeled sorted "
+  {
+    echo "$oid refs/heads/main"
+    echo "$oid refs/remotes/origin/main"
+    awk -v oid="$oid" -v n="$REFS" \
+      'BEGIN { for (i = 0; i < n; i++) printf "%s refs/remotes/mirror/branch-%07d\n", oid, i }'
+  } | LC_ALL=C sort -k2
+} > .git/packed-refs
+rm -f .git/refs/heads/main
+echo "packed-refs: $(du -h .git/packed-refs | cut -f1)"
+
+bench() {
+  local label="$1"
+  export GP_GIT_PROMPT="$2"
+  local start end
+  start=$(date +%s%N)
+  for ((i = 0; i < ITERATIONS; i++)); do
+    "$GENERATE_PROMPT" > /dev/null
+  done
+  end=$(date +%s%N)
+  awk -v label="$label" -v ns=$((end - start)) -v n="$ITERATIONS" \
+    'BEGIN { printf "%-28s %8.2f ms/prompt\n", label, ns / n / 1000000 }'
+}
+
+bench "ref-only (\\pr:\\pl)"      '\pr:\pl'
+bench "divergence (\\pR:\\pd)"    '\pR:\pd'
+bench "default prompt"           '[\pR/\pL/\pC]\pk\n$ '
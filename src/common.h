@@ -0,0 +1,20 @@
+/* --------------------------------------------------
+ * Limits and portability macros shared by the sources in src/
+ */
+#ifndef GENERATE_PROMPT_COMMON_H
+#define GENERATE_PROMPT_COMMON_H
+
+// max buffer sizes
+#define MAX_PATH_BUFFER_SIZE          2048
+#define MAX_REF_LINE_BUFFER_SIZE      1024
+
+// stat() timestamps; macOS names the struct stat fields differently
+#ifdef __APPLE__
+#define GP_STAT_MTIME(st)             ((st).st_mtimespec)
+#define GP_STAT_CTIME(st)             ((st).st_ctimespec)
+#else
+#define GP_STAT_MTIME(st)             ((st).st_mtim)
+#define GP_STAT_CTIME(st)             ((st).st_ctim)
+#endif
+
+#endif
@@ -7,21 +7,182 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dlfcn.h>
+
+#include "common.h"
+#include "index.h"
+#include "reftable.h"
+#include "sha1.h"
+#include "tasks.h"
+
+
+/* --------------------------------------------------
+ * libgit2
+ *
+ * libgit2 is not linked but opened with dlopen(), see loadLibgit2(),
+ * so that prompts which only show ref names don't pay for loading it
+ * and the libraries it depends on. Every libgit2 function used here is
+ * called through a pointer; the defines below turn each call into a
+ * call through its pointer.
+ */
+
+// the library to open, set by the Makefile
+#ifndef LIBGIT2_LIBRARY
+#define LIBGIT2_LIBRARY "libgit2.so"
+#endif
+
+#define LIBGIT2_FUNCTIONS(X) \
+  X(git_branch_upstream_name)         \
+  X(git_buf_dispose)                  \
+  X(git_commit_free)                  \
+  X(git_commit_lookup)                \
+  X(git_commit_parent_id)             \
+  X(git_commit_parentcount)           \
+  X(git_commit_time)                  \
+  X(git_commit_tree)                  \
+  X(git_commit_tree_id)               \
+  X(git_config_free)                  \
+  X(git_config_get_bool)              \
+  X(git_config_get_string)            \
+  X(git_diff_free)                    \
+  X(git_diff_index_to_workdir)        \
+  X(git_diff_tree_to_index)           \
+  X(git_filter_list_free)             \
+  X(git_filter_list_load)             \
+  X(git_index_add)                    \
+  X(git_index_conflict_iterator_free) \
+  X(git_index_conflict_iterator_new)  \
+  X(git_index_conflict_next)          \
+  X(git_index_entry_stage)            \
+  X(git_index_entrycount)             \
+  X(git_index_free)                   \
+  X(git_index_get_byindex)            \
+  X(git_index_path)                   \
+  X(git_libgit2_init)                 \
+  X(git_libgit2_shutdown)             \
+  X(git_oid_cmp)                      \
+  X(git_oid_cpy)                      \
+  X(git_oid_equal)                    \
+  X(git_oid_fromstr)                  \
+  X(git_oid_tostr)                    \
+  X(git_reference_free)               \
+  X(git_reference_lookup)             \
+  X(git_reference_shorthand)          \
+  X(git_reference_target)             \
+  X(git_repository_commondir)         \
+  X(git_repository_config_snapshot)   \
+  X(git_repository_discover)          \
+  X(git_repository_free)              \
+  X(git_repository_head)              \
+  X(git_repository_index)             \
+  X(git_repository_open)              \
+  X(git_repository_path)              \
+  X(git_repository_workdir)           \
+  X(git_tree_free)
+
+#define LIBGIT2_POINTER(name) static __typeof__(&name) libgit2_##name;
+LIBGIT2_FUNCTIONS(LIBGIT2_POINTER)
+
+#define git_branch_upstream_name(...)            libgit2_git_branch_upstream_name(__VA_ARGS__)
+#define git_buf_dispose(...)                     libgit2_git_buf_dispose(__VA_ARGS__)
+#define git_commit_free(...)                     libgit2_git_commit_free(__VA_ARGS__)
+#define git_commit_lookup(...)                   libgit2_git_commit_lookup(__VA_ARGS__)
+#define git_commit_parent_id(...)                libgit2_git_commit_parent_id(__VA_ARGS__)
+#define git_commit_parentcount(...)              libgit2_git_commit_parentcount(__VA_ARGS__)
+#define git_commit_time(...)                     libgit2_git_commit_time(__VA_ARGS__)
+#define git_commit_tree(...)                     libgit2_git_commit_tree(__VA_ARGS__)
+#define git_commit_tree_id(...)                  libgit2_git_commit_tree_id(__VA_ARGS__)
+#define git_config_free(...)                     libgit2_git_config_free(__VA_ARGS__)
+#define git_config_get_bool(...)                 libgit2_git_config_get_bool(__VA_ARGS__)
+#define git_config_get_string(...)               libgit2_git_config_get_string(__VA_ARGS__)
+#define git_diff_free(...)                       libgit2_git_diff_free(__VA_ARGS__)
+#define git_diff_index_to_workdir(...)           libgit2_git_diff_index_to_workdir(__VA_ARGS__)
+#define git_diff_tree_to_index(...)              libgit2_git_diff_tree_to_index(__VA_ARGS__)
+#define git_filter_list_free(...)                libgit2_git_filter_list_free(__VA_ARGS__)
+#define git_filter_list_load(...)                libgit2_git_filter_list_load(__VA_ARGS__)
+#define git_index_add(...)                       libgit2_git_index_add(__VA_ARGS__)
+#define git_index_conflict_iterator_free(...)    libgit2_git_index_conflict_iterator_free(__VA_ARGS__)
+#define git_index_conflict_iterator_new(...)     libgit2_git_index_conflict_iterator_new(__VA_ARGS__)
+#define git_index_conflict_next(...)             libgit2_git_index_conflict_next(__VA_ARGS__)
+#define git_index_entry_stage(...)               libgit2_git_index_entry_stage(__VA_ARGS__)
+#define git_index_entrycount(...)                libgit2_git_index_entrycount(__VA_ARGS__)
+#define git_index_free(...)                      libgit2_git_index_free(__VA_ARGS__)
+#define git_index_get_byindex(...)               libgit2_git_index_get_byindex(__VA_ARGS__)
+#define git_index_path(...)                      libgit2_git_index_path(__VA_ARGS__)
+#define git_libgit2_init(...)                    libgit2_git_libgit2_init(__VA_ARGS__)
+#define git_libgit2_shutdown(...)                libgit2_git_libgit2_shutdown(__VA_ARGS__)
+#define git_oid_cmp(...)                         libgit2_git_oid_cmp(__VA_ARGS__)
+#define git_oid_cpy(...)                         libgit2_git_oid_cpy(__VA_ARGS__)
+#define git_oid_equal(...)                       libgit2_git_oid_equal(__VA_ARGS__)
+#define git_oid_fromstr(...)                     libgit2_git_oid_fromstr(__VA_ARGS__)
+#define git_oid_tostr(...)                       libgit2_git_oid_tostr(__VA_ARGS__)
+#define git_reference_free(...)                  libgit2_git_reference_free(__VA_ARGS__)
+#define git_reference_lookup(...)                libgit2_git_reference_lookup(__VA_ARGS__)
+#define git_reference_shorthand(...)             libgit2_git_reference_shorthand(__VA_ARGS__)
+#define git_reference_target(...)                libgit2_git_reference_target(__VA_ARGS__)
+#define git_repository_commondir(...)            libgit2_git_repository_commondir(__VA_ARGS__)
+#define git_repository_config_snapshot(...)      libgit2_git_repository_config_snapshot(__VA_ARGS__)
+#define git_repository_discover(...)             libgit2_git_repository_discover(__VA_ARGS__)
+#define git_repository_free(...)                 libgit2_git_repository_free(__VA_ARGS__)
+#define git_repository_head(...)                 libgit2_git_repository_head(__VA_ARGS__)
+#define git_repository_index(...)                libgit2_git_repository_index(__VA_ARGS__)
+#define git_repository_open(...)                 libgit2_git_repository_open(__VA_ARGS__)
+#define git_repository_path(...)                 libgit2_git_repository_path(__VA_ARGS__)
+#define git_repository_workdir(...)              libgit2_git_repository_workdir(__VA_ARGS__)
+#define git_tree_free(...)                       libgit2_git_tree_free(__VA_ARGS__)
 
 
 /* --------------------------------------------------
  * Common global stuff
  */
 
-// max buffer sizes
-#define MAX_PATH_BUFFER_SIZE          2048
+// max buffer sizes (see also common.h)
 #define MAX_REPO_BUFFER_SIZE          256
 #define MAX_BRANCH_BUFFER_SIZE        256
 #define MAX_STYLE_BUFFER_SIZE         64
 #define MAX_PARAM_MESSAGE_BUFFER_SIZE 64
 
+// how many symbolic refs we follow before giving up (same as git)
+#define MAX_SYMREF_DEPTH              5
+
+// used when GP_GIT_PROMPT is unset
+#define DEFAULT_GIT_PROMPT            "[\\pR/\\pL/\\pC]\\pk\n$ "
+
+// used when GP_MAINLINE_REF is unset
+#define DEFAULT_MAINLINE_REF          "refs/remotes/upstream/main"
+
+// initial size of the commit table of countDivergence() (a power of two)
+#define DIVERGENCE_WALK_SLOTS         1024
+
+// how long a prompt waits for a concurrent one in the same repo (used
+// when GP_SINGLE_FLIGHT_WAIT_MS is unset), and how often it checks
+#define DEFAULT_SINGLE_FLIGHT_WAIT_MS 500
+#define SINGLE_FLIGHT_POLL_MS         2
+
+// --explain-cost: rows in the directory table, and the thresholds above
+// which a hint is given
+#define EXPLAIN_TABLE_ROWS            15
+#define EXPLAIN_HINT_STAT_FILES       1000
+#define EXPLAIN_HINT_IGNORE_CHECKS    100
+#define EXPLAIN_HINT_RENAME_PAIRS     100000
+#define EXPLAIN_HINT_REVWALK_COMMITS  1000
+#define MAX_HINTS                     8
+#define MAX_HINT_BUFFER_SIZE          256
+
+// hashing working-directory files, see checkWorkdirNative()
+#define MAX_HASH_THREADS              8
+#define HASH_READ_BUFFER_SIZE         (256 * 1024)
+
 
 enum states {
   RESET       = 0,
@@ -40,18 +201,57 @@ enum exit_code {
   // failure codes
   EXIT_FAIL_GIT_STATUS   = -1,
   EXIT_FAIL_REPO_OBJ     = -2,
+  EXIT_FAIL_LIBGIT2      = -3,
+};
+
+// what the instructions in a prompt pattern need to be computed.
+// Patterns which need none of these are rendered from the refs alone,
+// without initializing libgit2.
+enum prompt_needs {
+  NEEDS_STATUS             = 1 << 0,
+  NEEDS_DIVERGENCE         = 1 << 1,
+  NEEDS_DIVERGENCE_TARGETS = 1 << 2,
+};
+
+// the refs other than origin/<branch> which HEAD's divergence can be
+// shown against, see findDivergenceTarget()
+enum divergence_targets {
+  TARGET_UPSTREAM = 0,    // branch.<name>.remote and .merge (\pu)
+  TARGET_PUSH     = 1,    // where 'git push' would go (\pw)
+  TARGET_MAINLINE = 2,    // GP_MAINLINE_REF (\pm)
+  DIVERGENCE_TARGET_COUNT,
+};
+
+// the phases --explain-cost times
+enum cost_phases {
+  COST_OPEN       = 0,
+  COST_HEAD       = 1,
+  COST_PARSE      = 2,    // the native index parse
+  COST_INDEX      = 3,    // libgit2 loading the index
+  COST_STAGED     = 4,
+  COST_WORKDIR    = 5,
+  COST_HASH       = 6,    // hashing files whose stat data can't be trusted
+  COST_DIVERGENCE = 7,
+  COST_PHASE_COUNT,
+};
+
+// how far HEAD has diverged from one of the divergence_targets
+struct DivergenceTarget {
+  int found;
+  int ahead;
+  int behind;
 };
 
 // used to pass repo info around between functions
 struct RepoContext {
   // Repo generics
   git_repository  *repo_obj;
+  git_repository  *divergence_repo_obj;
   const char      *repo_name;
   const char      *repo_path;
   const char      *branch_name;
   git_reference   *head_ref;
   const git_oid   *head_oid;
-  git_status_list *status_list;
 
   // Repo state
   int s_repo;
@@ -63,13 +263,126 @@ struct RepoContext {
   int rebase_in_progress;
   int staged_changes;
   int unstaged_changes;
+  int revwalk_commits;              // commits the divergence walk visited
+  struct DivergenceTarget targets[DIVERGENCE_TARGET_COUNT];
 
   // application stuff
   int exit_code;
+  int divergence_targets;           // also walk the divergence_targets
+  struct CostReport *cost_report;   // set by --explain-cost
+
+  // storage for branch_name and head_oid when HEAD is read without
+  // libgit2
+  char    branch_buffer[MAX_BRANCH_BUFFER_SIZE];
+  git_oid head_oid_buffer;
+};
+
+// running totals for one streaming status pass, see countStatusDelta()
+struct StatusPass {
+  int staged;           // 1 for HEAD->index, 0 for index->workdir
+  int changes;
+  struct CostReport *cost_report;
+  int census;           // takeCostCensus(): count every delta, time nothing
+};
+
+// a prompt's claim on the per-repo lock, see joinSingleFlight()
+struct SingleFlight {
+  int    lock_fd;
+  int    locked;
+  struct timespec index_mtime;
+  off_t  index_size;
+  char   result_path[MAX_PATH_BUFFER_SIZE];
+};
+
+// the part of a RepoContext one prompt publishes for concurrent ones
+struct SharedResult {
+  unsigned long generation;
+  int           needs;
+  char          head_oid[GIT_OID_HEXSZ + 1];
+  char          branch[MAX_BRANCH_BUFFER_SIZE];
+  long long     index_mtime_sec;
+  long          index_mtime_nsec;
+  long long     index_size;
+  int           s_repo;
+  int           s_index;
+  int           s_wdir;
+  int           ahead;
+  int           behind;
+  int           conflict_count;
+  int           staged_changes;
+  int           unstaged_changes;
+  struct DivergenceTarget targets[DIVERGENCE_TARGET_COUNT];
+  char          mainline[MAX_BRANCH_BUFFER_SIZE];
+};
+
+// what the status pass cost in one top-level directory
+struct DirectoryCost {
+  char      *name;
+  double     milliseconds;
+  long       stat_count;
+  long       hashed_files;
+  long long  hashed_bytes;
+  long       ignore_checks;
+  long       submodules;
+};
+
+// collected by --explain-cost while the status pass runs
+struct CostReport {
+  struct timespec       mark;
+  double                phase_ms[COST_PHASE_COUNT];
+  struct DirectoryCost *directories;
+  int                   directory_count;
+  int                   last_directory;   // where the last progress callback was
+  struct timespec       last_progress;
+  long                  racy_entries;
+  long                  stat_changed_entries;
+  long                  staged_adds;
+  long                  staged_deletes;
+  int                   revwalk_commits;
+  size_t                index_blocks;     // blocks the native index parse was split into
+  int                   workdir_decided;  // checkWorkdirNative() settled the working directory
+};
+
+// shared by the threads of hashCandidates()
+struct HashJob {
+  const char           *workdir;
+  struct HashCandidate *candidates;
+  size_t                count;
+  size_t                next;       // next candidate to claim, atomically
+  Sha1Compress          compress;
+};
+
+// a commit met by countDivergence(). 'tips' has a bit for every tip
+// the commit is reachable from, bit 0 being HEAD.
+struct DivergenceCommit {
+  git_oid       id;
+  git_commit   *commit;
+  git_time_t    time;
+  unsigned int  tips;
+  int           queued;
+  size_t        sequence;   // orders queued commits with the same time
+};
+
+// the state of one countDivergence() walk
+struct DivergenceWalk {
+  git_repository          *repo;
+  struct DivergenceCommit *commits;
+  size_t                   commit_count;
+  size_t                   commit_capacity;
+  size_t                  *slots;           // hash table of commit index + 1
+  size_t                   slot_count;
+  size_t                  *queue;           // max-heap of commit indexes, newest first
+  size_t                   queue_length;
+  size_t                   sequence;
+  unsigned int             all_tips;
+  size_t                   queued_partial;  // queued commits not reachable from every tip
 };
 
 
 
+
+
+
 /* --------------------------------------------------
  * Declarations
  * For detailed descriptions, see the function definitions further in
@@ -85,16 +398,32 @@ void printGitPrompt(const struct RepoContext *repo_context);
 // Finds the path to a Git repository from a given path.
 const char *findGitRepositoryPath(const char *path);
 
-// Calculates commit divergence between local and upstream branches.
-int calculateDivergence(git_repository *repo,
-                        const git_oid *local_oid,
-                        const git_oid *upstream_oid,
-                        int *ahead,
-                        int *behind);
+// Counts HEAD's divergence from several tips in one walk.
+int countDivergence(git_repository *repo,
+                    const git_oid *head_oid,
+                    const git_oid *tips,
+                    int tip_count,
+                    int *ahead,
+                    int *behind);
+
+// Adds tips to a commit of a DivergenceWalk, queueing it if they are new.
+int reachDivergenceCommit(struct DivergenceWalk *walk, const git_oid *id, unsigned int tips);
+
+// Doubles the commit table of a DivergenceWalk.
+int growDivergenceSlots(struct DivergenceWalk *walk);
+
+// Removes the newest commit from the queue of a DivergenceWalk.
+size_t popDivergenceCommit(struct DivergenceWalk *walk);
+
+// Returns 1 if queued commit 'a' comes out of a DivergenceWalk before 'b'.
+int precedesDivergenceCommit(const struct DivergenceWalk *walk, size_t a, size_t b);
 
 // Replaces all instances of 'search' with 'replacement' in 'text'.
 char *substitute (const char *text, const char *search, const char *replacement);
 
+// Opens libgit2 and looks up the functions used.
+int loadLibgit2(void);
+
 // Initializes a RepoContext structure to default state.
 void initializeRepoStatus(struct RepoContext *repo_context);
 
@@ -113,20 +442,174 @@ void extractRepoAndBranchNames(struct RepoContext *repo_context);
 // Determines statuses of repo elements relative to index and working directory.
 void setupAndRetrieveGitStatus(struct RepoContext *repo_context);
 
+// Diff notify callback which counts a delta instead of storing it.
+int countStatusDelta(const git_diff *diff,
+                     const git_diff_delta *delta,
+                     const char *matched_pathspec,
+                     void *payload);
+
+// Checks the working directory against the index without libgit2's diff.
+int checkWorkdirNative(struct RepoContext *repo_context,
+                       const git_index_entry *entries,
+                       size_t entry_count,
+                       const struct stat *index_stat,
+                       int *changes);
+
+// Runs checkWorkdirNative() on an index loaded by libgit2.
+int checkWorkdirWithIndex(struct RepoContext *repo_context, git_index *index, int *changes);
+
+// Records refreshed stat data in libgit2's in-memory index.
+void refreshIndexEntries(struct RepoContext *repo_context,
+                         const struct HashCandidate *candidates,
+                         size_t count,
+                         const struct stat *index_stat);
+
+// Hashes HashCandidates on a pool of threads.
+void hashCandidates(const char *workdir, struct HashCandidate *candidates, size_t count);
+
+// Task which hashes HashCandidates until none are left.
+void runHashTask(void *argument);
+
+// Hashes a working-directory file as a git blob.
+int hashWorkdirFile(const char *path,
+                    const struct stat *file_stat,
+                    unsigned char *buffer,
+                    Sha1Compress compress,
+                    unsigned char digest[GIT_OID_RAWSZ]);
+
 // Checks if the repo is in the midst of an interactive rebase.
 void checkForInteractiveRebase(struct RepoContext *repo_context);
 
 // Identifies any conflicts/divergence between local and remote branches.
 void checkForConflictsAndDivergence(struct RepoContext *repo_context);
 
+// Calculates divergence from refs/remotes/origin/<branch> and the divergence_targets.
+void checkForDivergence(struct RepoContext *repo_context, git_repository *repo);
+
+// Finds the ref name of one of the divergence_targets.
+int findDivergenceTarget(const struct RepoContext *repo_context,
+                         git_repository *repo,
+                         int target,
+                         char *ref_name,
+                         size_t size);
+
+// Resolves a ref to the commit a divergence is counted from.
+int resolveDivergenceTip(git_repository *repo, const char *ref_name, git_oid *oid);
+
+// Returns GP_MAINLINE_REF, its default, or NULL if it is set empty.
+const char *getMainlineRef(void);
+
+// Runs the status and divergence phases at the same time.
+void retrieveStatusAndDivergence(struct RepoContext *repo_context, int needs);
+
+// Task wrapper for setupAndRetrieveGitStatus().
+void runStatusTask(void *argument);
+
+// Task wrapper for checkForDivergence() on its own repository handle.
+void runDivergenceTask(void *argument);
+
+// Returns which prompt_needs the instructions in a prompt pattern have.
+int getPromptNeeds(const char *prompt);
+
+// Renders prompts which only need ref names, without libgit2.
+int printRefOnlyPrompt(struct RepoContext *repo_context);
+
+// Locates the git directory above the cwd, without libgit2.
+int findGitDirectoryNative(char *repo_path, char *git_dir);
+
+// Resolves a (possibly symbolic) ref to its final name and object id.
+int resolveRefNative(const char *git_dir,
+                     const char *common_dir,
+                     const char *ref_name,
+                     char *resolved_name,
+                     char *oid_hex);
+
+// Looks up a single ref in the packed-refs file.
+int lookupPackedRef(const char *common_dir, const char *ref_name, char *oid_hex);
+
+// Binary-searches a sorted packed-refs buffer for a ref.
+const char *searchPackedRefs(const char *start, const char *end, const char *ref_name);
+
+// Compares the ref name of a packed-refs record with 'ref_name'.
+int comparePackedRecord(const char *record, const char *end, const char *ref_name);
+
+// Reads the first line of a small file, such as a loose ref.
+int readFirstLine(const char *path, char *buffer, size_t size);
+
+// Strips the refs/heads/ (etc.) prefix from a full ref name.
+const char *shortenRefName(const char *ref_name);
+
+// Takes the per-repo lock, or waits for and reuses a concurrent result.
+int joinSingleFlight(struct RepoContext *repo_context,
+                     int needs,
+                     struct SingleFlight *flight);
+
+// Publishes the result (if we computed it) and releases the lock.
+void finishSingleFlight(const struct RepoContext *repo_context,
+                        int needs,
+                        struct SingleFlight *flight);
+
+// Builds the lock and result file paths for a repository.
+int getSingleFlightPaths(const struct RepoContext *repo_context,
+                         char *lock_path,
+                         char *result_path);
+
+// Reads a published SharedResult.
+int readSharedResult(const char *path, struct SharedResult *result);
+
+// Runs the status pass instrumented and prints where the time went.
+int explainCost(int json);
+
+// Adds the time since the last mark to a phase of a CostReport.
+void markCostPhase(struct CostReport *report, int phase);
+
+// Diff progress callback attributing working-directory time to directories.
+int recordWorkdirProgress(const git_diff *diff,
+                          const char *old_path,
+                          const char *new_path,
+                          void *payload);
+
+// Returns the DirectoryCost for the top-level directory of a path.
+struct DirectoryCost *findDirectoryCost(struct CostReport *report, const char *path);
+
+// Counts what the timed passes of --explain-cost stop short of.
+void takeCostCensus(struct RepoContext *repo_context, struct CostReport *report);
+
+// Estimates which index entries the status pass had to hash.
+void estimateHashCost(struct RepoContext *repo_context, struct CostReport *report);
+
+// Fills in fix suggestions for a CostReport.
+int collectCostHints(const struct CostReport *report,
+                     char hints[][MAX_HINT_BUFFER_SIZE]);
+
+// Prints a CostReport as a table or as JSON.
+void printCostReport(const struct RepoContext *repo_context,
+                     struct CostReport *report,
+                     int json);
+
+// qsort comparator ranking DirectoryCosts, most expensive first.
+int compareDirectoryCost(const void *a, const void *b);
+
+// Prints a string as a JSON string literal.
+void printJsonString(const char *text);
+
+// Formats a byte count for humans (e.g. "4.2 MiB").
+const char *formatByteCount(long long bytes, char *buffer, size_t size);
+
+// Milliseconds between two CLOCK_MONOTONIC timestamps.
+double elapsedMilliseconds(const struct timespec *since, const struct timespec *until);
+
 // Function to display help message
 void displayHelp(const char *message) {
   printf("USAGE\n");
-  printf("  generate-prompt [-h|-H]\n");
+  printf("  generate-prompt [-h|-H|--explain-cost[=json]]\n");
   printf("\n");
   printf("OPTIONS\n");
   printf("  -h    This help message\n");
   printf("  -H    Show all configuration options\n");
+  printf("  --explain-cost[=table|json]\n");
+  printf("        Run the prompt's status pass and report where its time and I/O\n");
+  printf("        went, per phase and per top-level directory, with hints\n");
   printf("\n");
 
   printf("OVERVIEW\n");
@@ -168,6 +651,13 @@ void displayConfigHelp() {
   printf("  GP_A_DIVERGENCE_STYLE            style for \\pa instruction\n");
   printf("  GP_B_DIVERGENCE_STYLE            style for \\pb instruction\n");
   printf("  GP_AB_DIVERGENCE_STYLE           style for \\pd instruction\n");
+  printf("  GP_U_DIVERGENCE_STYLE            style for \\pu instruction\n");
+  printf("  GP_W_DIVERGENCE_STYLE            style for \\pw instruction\n");
+  printf("  GP_M_DIVERGENCE_STYLE            style for \\pm instruction\n");
+  printf("  GP_MAINLINE_REF                  ref \\pm compares with (default refs/remotes/upstream/main)\n");
+  printf("  GP_SERIAL                        if set, run status and divergence one after another\n");
+  printf("  GP_SINGLE_FLIGHT_WAIT_MS         ms to wait for a concurrent prompt in the same repo (0 disables)\n");
+  printf("  GP_REFRESH_INDEX                 if set, write refreshed stat data back to the index\n");
   printf("\n\n");
 
   printf("INSTRUCTION OVERVIEW\n");
@@ -181,6 +671,9 @@ void displayConfigHelp() {
   printf("  \\pa     ref divergence, ahead of upstream\n");
   printf("  \\pb     ref divergence, behind upstream\n");
   printf("  \\pd     ref divergence, ahead and behind\n");
+  printf("  \\pu     divergence from the configured upstream, ahead and behind\n");
+  printf("  \\pw     divergence from the push destination, ahead and behind\n");
+  printf("  \\pm     divergence from GP_MAINLINE_REF, ahead and behind\n");
   printf("\n");
   printf("  \\pi     show if interactive rebase\n");
   printf("  \\pK     show if conflict (coloured)\n");
@@ -226,6 +719,12 @@ int main(int argc, char *argv[]) {
       displayConfigHelp();
       return 0;
     }
+    if (strcmp(argv[i], "--explain-cost") == 0 || strcmp(argv[i], "--explain-cost=table") == 0) {
+      return explainCost(0);
+    }
+    if (strcmp(argv[i], "--explain-cost=json") == 0) {
+      return explainCost(1);
+    }
     else {
       char message[MAX_PARAM_MESSAGE_BUFFER_SIZE];
       sprintf(message, "Parameter '%s' unknown", argv[i]);
@@ -235,9 +734,22 @@ int main(int argc, char *argv[]) {
   }
 
   struct RepoContext repo_context;
-  git_libgit2_init();
   initializeRepoStatus(&repo_context);
 
+  // If the prompt only shows names, there's no need to pay for
+  // libgit2 at all. Falls through when the repo layout is something
+  // the native reader doesn't handle.
+  const char *prompt = getenv("GP_GIT_PROMPT") ?: DEFAULT_GIT_PROMPT;
+  if (getPromptNeeds(prompt) == 0 && printRefOnlyPrompt(&repo_context)) {
+    return repo_context.exit_code;
+  }
+
+  if (!loadLibgit2()) {
+    printNonGitPrompt();
+    return EXIT_FAIL_LIBGIT2;
+  }
+  git_libgit2_init();
+
   if(!findAndOpenGitRepository(&repo_context)) {
     printNonGitPrompt();
     git_libgit2_shutdown();
@@ -251,9 +763,31 @@ int main(int argc, char *argv[]) {
   }
 
   extractRepoAndBranchNames(&repo_context);
-  setupAndRetrieveGitStatus(&repo_context);
   checkForInteractiveRebase(&repo_context);
-  checkForConflictsAndDivergence(&repo_context);
+
+  // the serial path always computes everything
+  const int serial = getenv("GP_SERIAL") != NULL;
+  const int needs  = serial ? NEEDS_STATUS | NEEDS_DIVERGENCE | NEEDS_DIVERGENCE_TARGETS : getPromptNeeds(prompt);
+  repo_context.divergence_targets = (needs & NEEDS_DIVERGENCE_TARGETS) != 0;
+
+  // prompts redrawn at the same time in the same repo share one scan
+  struct SingleFlight flight;
+  if (!joinSingleFlight(&repo_context, needs, &flight)) {
+    if (serial) {
+      setupAndRetrieveGitStatus(&repo_context);
+      checkForConflictsAndDivergence(&repo_context);
+    }
+    else {
+      retrieveStatusAndDivergence(&repo_context, needs);
+    }
+  }
+  finishSingleFlight(&repo_context, needs, &flight);
+
+  if (repo_context.exit_code != 0) {
+    printNonGitPrompt();
+    cleanupResources(&repo_context);
+    return repo_context.exit_code;
+  }
 
   printGitPrompt(&repo_context);
 
@@ -283,7 +817,7 @@ const char *findGitRepositoryPath(const char *path) {
       *last_slash = '\0';  // Null-terminate the string at the last slash
     }
     char *result = strdup(repo_path.ptr);  // Duplicate the path before freeing the buffer
-    git_buf_free(&repo_path);
+    git_buf_dispose(&repo_path);
     return result;
   }
 
@@ -328,7 +862,7 @@ void printNonGitPrompt() {
 void printGitPrompt(const struct RepoContext *repo_context) {
 
   // environment, else default values
-  const char *undigestedPrompt = getenv("GP_GIT_PROMPT") ?: "[\\pR/\\pL/\\pC]\\pk\n$ ";
+  const char *undigestedPrompt = getenv("GP_GIT_PROMPT") ?: DEFAULT_GIT_PROMPT;
   const char *colour[5] = {
     [ RESET       ] = getenv("GP_RESET")      ?: "\\[\033[0m\\]",
     [ NO_DATA     ] = getenv("GP_NO_DATA")    ?: "\\[\033[0;37m\\]",
@@ -343,6 +877,11 @@ void printGitPrompt(const struct RepoContext *repo_context) {
   const char *a_divergence_style  = getenv("GP_A_DIVERGENCE_STYLE")            ?: "%d";
   const char *b_divergence_style  = getenv("GP_B_DIVERGENCE_STYLE")            ?: "%d";
   const char *ab_divergence_style = getenv("GP_AB_DIVERGENCE_STYLE")           ?: "(%d,-%d)";
+  const char *target_styles[DIVERGENCE_TARGET_COUNT] = {
+    [ TARGET_UPSTREAM ] = getenv("GP_U_DIVERGENCE_STYLE")                      ?: "(%d,-%d)",
+    [ TARGET_PUSH     ] = getenv("GP_W_DIVERGENCE_STYLE")                      ?: "(%d,-%d)",
+    [ TARGET_MAINLINE ] = getenv("GP_M_DIVERGENCE_STYLE")                      ?: "(%d,-%d)",
+  };
 
 
   // handle working directory (wd) style
@@ -351,40 +890,40 @@ void printGitPrompt(const struct RepoContext *repo_context) {
   getcwd(full_path, sizeof(full_path));
   if (strcmp(wd_style, "basename") == 0) {
     // show basename of directory path
-    sprintf(wd, "%s", basename(full_path));
+    snprintf(wd, sizeof(wd), "%s", basename(full_path));
   }
   else if (strcmp(wd_style, "cwd") == 0) {
     // show the entire path, from $HOME
     const char *home = getenv("HOME") ?: "";
     size_t common_length = strspn(full_path, home);
-    sprintf(wd, "~/%s", full_path + common_length);
+    snprintf(wd, sizeof(wd), "~/%s", full_path + common_length);
   }
   else if (strcmp(wd_style, "gitrelpath_exclusive") == 0) {
     // show the entire path, from git-root (exclusive)
     size_t common_length = strspn(repo_context->repo_path, full_path);
     if (common_length == strlen(full_path)) {
-      sprintf(wd, "%s", wd_relroot_pattern);
+      snprintf(wd, sizeof(wd), "%s", wd_relroot_pattern);
     }
     else {
-      sprintf(wd, "%s%s", wd_relroot_pattern, full_path + common_length + 1);
+      snprintf(wd, sizeof(wd), "%s%s", wd_relroot_pattern, full_path + common_length + 1);
     }
   }
   else if (strcmp(wd_style, "gitrelpath_inclusive") == 0) {
     // show the entire path, from git-root (inclusive)
     size_t common_length = strspn(dirname((char *) repo_context->repo_path), full_path) + 1;
-    sprintf(wd, "%s", full_path + common_length);
+    snprintf(wd, sizeof(wd), "%s", full_path + common_length);
   }
   else {
     // if GP_WD_STYLE is set, but doesn't match any of the above
     // conditions, assume it can be safely added to the prompt. if it
     // isn't set, go with basename (set above)
-    sprintf(wd, "%s", wd_style);
+    snprintf(wd, sizeof(wd), "%s", wd_style);
   }
 
   // handle interactive rebase style
   char rebase[MAX_STYLE_BUFFER_SIZE];
   if (repo_context->rebase_in_progress == 1) {
-    sprintf(rebase, "%s", rebase_style);
+    snprintf(rebase, sizeof(rebase), "%s", rebase_style);
   }
   else {
     rebase[0] = '\0';
@@ -394,17 +933,18 @@ void printGitPrompt(const struct RepoContext *repo_context) {
   // substitute base instructions
   char repo_colour[MAX_REPO_BUFFER_SIZE]     = { '\0' };
   char branch_colour[MAX_BRANCH_BUFFER_SIZE] = { '\0' };
-  char cwd_colour[MAX_PATH_BUFFER_SIZE]      = { '\0' };
-  sprintf(repo_colour,   "%s%s%s", colour[repo_context->s_repo],  repo_context->repo_name,   colour[RESET]);
-  sprintf(branch_colour, "%s%s%s", colour[repo_context->s_index], repo_context->branch_name, colour[RESET]);
-  sprintf(cwd_colour,    "%s%s%s", colour[repo_context->s_wdir],  wd,                        colour[RESET]);
+  // room for a full path and the colour codes around it
+  char cwd_colour[MAX_PATH_BUFFER_SIZE + 2 * MAX_STYLE_BUFFER_SIZE] = { '\0' };
+  snprintf(repo_colour,   sizeof(repo_colour),   "%s%s%s", colour[repo_context->s_repo],  repo_context->repo_name,   colour[RESET]);
+  snprintf(branch_colour, sizeof(branch_colour), "%s%s%s", colour[repo_context->s_index], repo_context->branch_name, colour[RESET]);
+  snprintf(cwd_colour,    sizeof(cwd_colour),    "%s%s%s", colour[repo_context->s_wdir],  wd,                        colour[RESET]);
 
   // prep for conflicts
   char conflict[MAX_STYLE_BUFFER_SIZE]        = { '\0' };
   char conflict_colour[MAX_STYLE_BUFFER_SIZE] = { '\0' };
   if (repo_context->conflict_count > 0) {
-    sprintf(conflict, conflict_style, repo_context->conflict_count);
-    sprintf(conflict_colour, "%s%s%s", colour[CONFLICT], conflict, colour[RESET]);
+    snprintf(conflict, sizeof(conflict), conflict_style, repo_context->conflict_count);
+    snprintf(conflict_colour, sizeof(conflict_colour), "%s%s%s", colour[CONFLICT], conflict, colour[RESET]);
   }
 
   // prep for commit divergence
@@ -412,11 +952,19 @@ void printGitPrompt(const struct RepoContext *repo_context) {
   char divergence_a[MAX_STYLE_BUFFER_SIZE]  = { '\0' };
   char divergence_b[MAX_STYLE_BUFFER_SIZE]  = { '\0' };
   if (repo_context->ahead + repo_context->behind > 0)
-    sprintf(divergence_ab, ab_divergence_style, repo_context->ahead, repo_context->behind);
+    snprintf(divergence_ab, sizeof(divergence_ab), ab_divergence_style, repo_context->ahead, repo_context->behind);
   if (repo_context->ahead != 0)
-    sprintf(divergence_a, a_divergence_style, repo_context->ahead);
+    snprintf(divergence_a, sizeof(divergence_a), a_divergence_style, repo_context->ahead);
   if (repo_context->behind != 0)
-    sprintf(divergence_b, b_divergence_style, repo_context->behind);
+    snprintf(divergence_b, sizeof(divergence_b), b_divergence_style, repo_context->behind);
+
+  // prep for divergence from the other targets
+  char divergence_targets[DIVERGENCE_TARGET_COUNT][MAX_STYLE_BUFFER_SIZE] = { { '\0' } };
+  for (int i = 0; i < DIVERGENCE_TARGET_COUNT; i++) {
+    const struct DivergenceTarget *target = &repo_context->targets[i];
+    if (target->found && target->ahead + target->behind > 0)
+      snprintf(divergence_targets[i], sizeof(divergence_targets[i]), target_styles[i], target->ahead, target->behind);
+  }
 
   // prep for showing user-class dependent symbol
   char show_prompt_colour[MAX_STYLE_BUFFER_SIZE] = { '\0'};
@@ -445,8 +993,8 @@ void printGitPrompt(const struct RepoContext *repo_context) {
   else {
     prompt_symbol = "$";
   }
-  sprintf(show_prompt_colour, "%s%s%s", colour[repo_context->s_wdir], prompt_symbol, colour[RESET]);
-  sprintf(show_prompt, "%s", prompt_symbol);
+  snprintf(show_prompt_colour, sizeof(show_prompt_colour), "%s%s%s", colour[repo_context->s_wdir], prompt_symbol, colour[RESET]);
+  snprintf(show_prompt, sizeof(show_prompt), "%s", prompt_symbol);
 
   // apply all instructions found
   //
@@ -469,6 +1017,10 @@ void printGitPrompt(const struct RepoContext *repo_context) {
     { "\\pa", divergence_a             },
     { "\\pb", divergence_b             },
 
+    { "\\pu", divergence_targets[TARGET_UPSTREAM] },
+    { "\\pw", divergence_targets[TARGET_PUSH]     },
+    { "\\pm", divergence_targets[TARGET_MAINLINE] },
+
     { "\\pi", rebase                   },
 
     { "\\pP", show_prompt_colour       },
@@ -487,67 +1039,234 @@ void printGitPrompt(const struct RepoContext *repo_context) {
 
 
 /**
- * Calculates the commit divergence between a local branch and its
- * upstream counterpart. It provides information about how many
- * commits the local branch is ahead or behind the upstream.
+ * Counts how far HEAD has diverged from several tips in a single walk,
+ * instead of one pair of revwalks per tip. Every commit met carries a
+ * bit for each tip it is reachable from (bit 0 is HEAD); the bits are
+ * passed on to the parents, newest commit first, and a commit is
+ * queued again whenever it gains a bit. Once every queued commit is
+ * reachable from all the tips, nothing older can change the counts
+ * and the walk stops, like git's merge-base search does. As with git,
+ * commits whose timestamps are older than those of their parents can
+ * make this stop too early.
+ *
+ * @param repo      The repository to walk.
+ * @param head_oid  The commit HEAD points to.
+ * @param tips      The commits to count the divergence from.
+ * @param tip_count Number of tips (at most 31).
+ * @param ahead     Output array: for each tip, the number of commits
+ *                  reachable from HEAD but not from the tip.
+ * @param behind    Output array: for each tip, the number of commits
+ *                  reachable from the tip but not from HEAD.
  *
- * @param repo        Pointer to the Git repository in context.
- * @param local_oid   OID (Object ID) of the local branch's latest
- *                    commit.
- * @param upstream_oid OID of the upstream branch's latest commit.
- * @param ahead       Output parameter where the number of commits
- *                    the local branch is ahead of upstream will be
- *                    stored.
- * @param behind      Output parameter where the number of commits
- *                    the local branch is behind the upstream will be
- *                    stored.
- *                    
- * @return Returns 0 on successful calculation, otherwise returns a
- *         non-zero error code.
+ * @return Returns the number of commits walked, or -1 if HEAD or a tip
+ *         can't be read (the counts are then 0).
  */
-int calculateDivergence(git_repository *repo,
-                        const git_oid *local_oid,
-                        const git_oid *upstream_oid,
-                        int *ahead,
-                        int *behind) {
-  int aheadCount = 0;
-  int behindCount = 0;
-  git_oid id;
+int countDivergence(git_repository *repo,
+                    const git_oid *head_oid,
+                    const git_oid *tips,
+                    int tip_count,
+                    int *ahead,
+                    int *behind) {
+  memset(ahead,  0, tip_count * sizeof(*ahead));
+  memset(behind, 0, tip_count * sizeof(*behind));
+
+  struct DivergenceWalk walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.repo     = repo;
+  walk.all_tips = (1u << (tip_count + 1)) - 1;
+
+  int walked = 0;
+  int failed = reachDivergenceCommit(&walk, head_oid, 1) != 0;
+  for (int i = 0; i < tip_count && !failed; i++) {
+    failed = reachDivergenceCommit(&walk, &tips[i], 1u << (i + 1)) != 0;
+  }
+
+  // the oldest commit which was walked before all tips reached it;
+  // without clock skew only commits at least as new can reach it
+  git_time_t partial_floor = INT64_MAX;
+
+  while (!failed && walk.queue_length > 0) {
+    if (walk.queued_partial == 0 && walk.commits[walk.queue[0]].time < partial_floor) break;
+
+    const size_t index = popDivergenceCommit(&walk);
+    git_commit *commit = walk.commits[index].commit;
+    const unsigned int tips_reached = walk.commits[index].tips;
+    if (tips_reached != walk.all_tips) {
+      walk.queued_partial--;
+      if (walk.commits[index].time < partial_floor) partial_floor = walk.commits[index].time;
+    }
+    walked++;
+
+    // a missing parent (e.g. in a shallow clone) ends that line
+    const unsigned int parent_count = git_commit_parentcount(commit);
+    for (unsigned int i = 0; i < parent_count; i++) {
+      reachDivergenceCommit(&walk, git_commit_parent_id(commit, i), tips_reached);
+    }
+  }
+
+  for (size_t i = 0; i < walk.commit_count && !failed; i++) {
+    const unsigned int tips_reached = walk.commits[i].tips;
+    for (int tip = 0; tip < tip_count; tip++) {
+      const unsigned int tip_bit = 1u << (tip + 1);
+      if ((tips_reached & 1) && !(tips_reached & tip_bit)) ahead[tip]++;
+      if (!(tips_reached & 1) && (tips_reached & tip_bit)) behind[tip]++;
+    }
+  }
+
+  for (size_t i = 0; i < walk.commit_count; i++) {
+    git_commit_free(walk.commits[i].commit);
+  }
+  free(walk.commits);
+  free(walk.slots);
+  free(walk.queue);
+  return failed ? -1 : walked;
+}
 
 
-  // init walker
-  git_revwalk *walker = NULL;
-  if (git_revwalk_new(&walker, repo) != 0) {
+/**
+ * Adds tips to a commit of a DivergenceWalk. A commit met for the
+ * first time is looked up and added to the commit table; a commit
+ * which gains a tip is queued, so that its parents gain it too.
+ *
+ * @param walk: The DivergenceWalk.
+ * @param id:   The commit.
+ * @param tips: The tip bits which reach it.
+ *
+ * @return Returns 0 on success, or -1 if the commit can't be read.
+ */
+int reachDivergenceCommit(struct DivergenceWalk *walk, const git_oid *id, unsigned int tips) {
+  if ((walk->commit_count + 1) * 2 > walk->slot_count && growDivergenceSlots(walk) != 0) {
     return -1;
   }
 
-  // count number of commits ahead
-  if (git_revwalk_push(walker, local_oid)    != 0 ||  // set where I want to start
-      git_revwalk_hide(walker, upstream_oid) != 0) {  // set where the walk ends (exclusive)
-    git_revwalk_free(walker);
-    return -2;
+  // the object id is already a hash
+  size_t hash;
+  memcpy(&hash, id->id, sizeof(hash));
+  size_t slot = hash & (walk->slot_count - 1);
+  while (walk->slots[slot] &&
+         !git_oid_equal(&walk->commits[walk->slots[slot] - 1].id, id)) {
+    slot = (slot + 1) & (walk->slot_count - 1);
   }
-  while (git_revwalk_next(&id, walker) == 0) aheadCount++;
 
+  if (!walk->slots[slot]) {
+    if (walk->commit_count == walk->commit_capacity) {
+      const size_t capacity = walk->commit_capacity ? walk->commit_capacity * 2 : DIVERGENCE_WALK_SLOTS / 2;
+      struct DivergenceCommit *commits = realloc(walk->commits, capacity * sizeof(*commits));
+      if (commits) walk->commits = commits;
+      size_t *queue = realloc(walk->queue, capacity * sizeof(*queue));
+      if (queue) walk->queue = queue;
+      if (!commits || !queue) return -1;
+      walk->commit_capacity = capacity;
+    }
+
+    struct DivergenceCommit *added = &walk->commits[walk->commit_count];
+    memset(added, 0, sizeof(*added));
+    if (git_commit_lookup(&added->commit, walk->repo, id) != 0) return -1;
+    git_oid_cpy(&added->id, id);
+    added->time = git_commit_time(added->commit);
+    walk->slots[slot] = ++walk->commit_count;
+  }
 
-  // count number of commits behind
-  git_revwalk_reset(walker);
-  if (git_revwalk_push(walker, upstream_oid) != 0 || // set where I want to start
-      git_revwalk_hide(walker, local_oid)    != 0) { // set where the walk ends (exclusive)
-    git_revwalk_free(walker);
-    return -3;
+  const size_t index = walk->slots[slot] - 1;
+  struct DivergenceCommit *commit = &walk->commits[index];
+  if ((commit->tips | tips) == commit->tips) return 0;
+
+  if (commit->queued && (commit->tips | tips) == walk->all_tips) walk->queued_partial--;
+  commit->tips |= tips;
+  if (commit->queued) return 0;
+
+  // sift up
+  commit->queued   = 1;
+  commit->sequence = walk->sequence++;
+  if (commit->tips != walk->all_tips) walk->queued_partial++;
+  size_t position = walk->queue_length++;
+  while (position > 0) {
+    const size_t parent = (position - 1) / 2;
+    if (!precedesDivergenceCommit(walk, index, walk->queue[parent])) break;
+    walk->queue[position] = walk->queue[parent];
+    position = parent;
   }
-  while (git_revwalk_next(&id, walker) == 0) behindCount++;
+  walk->queue[position] = index;
+  return 0;
+}
 
 
-  *ahead = aheadCount;
-  *behind = behindCount;
+/**
+ * Doubles the commit table of a DivergenceWalk (or creates it), and
+ * puts the commits met so far back into it.
+ *
+ * @param walk: The DivergenceWalk.
+ *
+ * @return Returns 0 on success, or -1 if out of memory.
+ */
+int growDivergenceSlots(struct DivergenceWalk *walk) {
+  const size_t slot_count = walk->slot_count ? walk->slot_count * 2 : DIVERGENCE_WALK_SLOTS;
+  size_t *slots = calloc(slot_count, sizeof(*slots));
+  if (!slots) return -1;
+
+  for (size_t i = 0; i < walk->commit_count; i++) {
+    size_t hash;
+    memcpy(&hash, walk->commits[i].id.id, sizeof(hash));
+    size_t slot = hash & (slot_count - 1);
+    while (slots[slot]) slot = (slot + 1) & (slot_count - 1);
+    slots[slot] = i + 1;
+  }
 
-  git_revwalk_free(walker);
+  free(walk->slots);
+  walk->slots      = slots;
+  walk->slot_count = slot_count;
   return 0;
 }
 
 
+/**
+ * Removes the newest commit from the queue of a DivergenceWalk.
+ *
+ * @param walk: The DivergenceWalk, with a non-empty queue.
+ *
+ * @return Returns the index of the commit.
+ */
+size_t popDivergenceCommit(struct DivergenceWalk *walk) {
+  const size_t top  = walk->queue[0];
+  const size_t last = walk->queue[--walk->queue_length];
+  walk->commits[top].queued = 0;
+
+  // sift down
+  size_t position = 0;
+  for (;;) {
+    size_t child = position * 2 + 1;
+    if (child >= walk->queue_length) break;
+    if (child + 1 < walk->queue_length &&
+        precedesDivergenceCommit(walk, walk->queue[child + 1], walk->queue[child])) {
+      child++;
+    }
+    if (!precedesDivergenceCommit(walk, walk->queue[child], last)) break;
+    walk->queue[position] = walk->queue[child];
+    position = child;
+  }
+  if (walk->queue_length > 0) walk->queue[position] = last;
+  return top;
+}
+
+
+/**
+ * Orders the queue of a DivergenceWalk: newest commit first, and in
+ * the order they were queued for equal commit times, as git does.
+ *
+ * @param walk: The DivergenceWalk.
+ * @param a:    Index of a queued commit.
+ * @param b:    Index of another queued commit.
+ *
+ * @return Returns 1 if 'a' is walked before 'b', otherwise 0.
+ */
+int precedesDivergenceCommit(const struct DivergenceWalk *walk, size_t a, size_t b) {
+  const struct DivergenceCommit *first  = &walk->commits[a];
+  const struct DivergenceCommit *second = &walk->commits[b];
+  if (first->time != second->time) return first->time > second->time;
+  return first->sequence < second->sequence;
+}
+
+
 /**
  * Helper function that performs a string substitution operation.
  * It searches for occurrences of a 'search' string within a 'text'
@@ -591,6 +1310,35 @@ char *substitute(const char *text, const char *search, const char *replacement)
 }
 
 
+/**
+ * Opens libgit2 with dlopen() and looks up every function in
+ * LIBGIT2_FUNCTIONS. Called once, before git_libgit2_init(), and only
+ * by prompts which need more than ref names.
+ *
+ * @return Returns 1 on success. Otherwise an error is printed to
+ *         stderr and 0 is returned.
+ */
+int loadLibgit2(void) {
+  void *library = dlopen(LIBGIT2_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    fprintf(stderr, "generate-prompt: %s\n", dlerror());
+    return 0;
+  }
+
+#define LIBGIT2_LOOKUP(name)                                            \
+  libgit2_##name = (__typeof__(libgit2_##name)) dlsym(library, #name);  \
+  if (!libgit2_##name) {                                                \
+    fprintf(stderr, "generate-prompt: %s\n", dlerror());                \
+    dlclose(library);                                                   \
+    return 0;                                                           \
+  }
+  LIBGIT2_FUNCTIONS(LIBGIT2_LOOKUP)
+#undef LIBGIT2_LOOKUP
+
+  return 1;
+}
+
+
 /**
  * Initializes the given RepoContext object to its default state. The
  * RepoContext structure is utilized to share repository-related state
@@ -601,21 +1349,25 @@ char *substitute(const char *text, const char *search, const char *replacement)
  */
 void initializeRepoStatus(struct RepoContext *repo_context) {
   repo_context->repo_obj           = NULL;
+  repo_context->divergence_repo_obj = NULL;
   repo_context->repo_name          = NULL;
   repo_context->repo_path          = NULL;
   repo_context->branch_name        = NULL;
   repo_context->head_ref           = NULL;
   repo_context->head_oid           = NULL;
-  repo_context->status_list        = NULL;
   repo_context->s_repo             = UP_TO_DATE;
   repo_context->s_index            = UP_TO_DATE;
   repo_context->s_wdir             = UP_TO_DATE;
   repo_context->ahead              = 0;
   repo_context->behind             = 0;
+  repo_context->revwalk_commits    = 0;
   repo_context->conflict_count     = 0;
   repo_context->rebase_in_progress = 0;
   repo_context->staged_changes     = 0;
   repo_context->unstaged_changes   = 0;
+  repo_context->divergence_targets = 0;
+  memset(repo_context->targets, 0, sizeof(repo_context->targets));
+  repo_context->cost_report        = NULL;
   repo_context->exit_code          = 0;
 }
 
@@ -665,14 +1417,14 @@ void cleanupResources(struct RepoContext *repo_context) {
     git_repository_free(repo_context->repo_obj);
     repo_context->repo_obj = NULL;
   }
+  if (repo_context->divergence_repo_obj) {
+    git_repository_free(repo_context->divergence_repo_obj);
+    repo_context->divergence_repo_obj = NULL;
+  }
   if (repo_context->head_ref) {
     git_reference_free(repo_context->head_ref);
     repo_context->head_ref = NULL;
   }
-  if (repo_context->status_list) {
-    git_status_list_free(repo_context->status_list);
-    repo_context->status_list = NULL;
-  }
   if (repo_context->repo_path) {
     free((void *) repo_context->repo_path);
     repo_context->repo_path = NULL;
@@ -682,14 +1434,36 @@ void cleanupResources(struct RepoContext *repo_context) {
 
 
 /**
- * Attempts to acquire the head_ref and head_oid of the specified repo.
+ * Attempts to acquire the head_oid and branch name of the specified
+ * repo. HEAD is resolved with resolveRefNative(), so a huge
+ * packed-refs file is binary-searched instead of being loaded by
+ * libgit2. If that fails to parse something, libgit2 resolves HEAD
+ * and head_ref is kept.
  *
  * @param repo_context: Pointer to a RepoContext structure where the
- *                     head_ref and head_oid will be stored if found.
+ *                     head_oid (and possibly head_ref) will be stored
+ *                     if found.
  * @return Returns 1 if successful in acquiring the references, and 0
  *                     otherwise.
  */
 int getRepoHeadRef(struct RepoContext *repo_context) {
+  char head_name[MAX_BRANCH_BUFFER_SIZE];
+  char head_oid_hex[GIT_OID_HEXSZ + 1];
+  const int resolved = resolveRefNative(git_repository_path(repo_context->repo_obj),
+                                        git_repository_commondir(repo_context->repo_obj),
+                                        "HEAD",
+                                        head_name,
+                                        head_oid_hex);
+  if (resolved == 0) {
+    repo_context->exit_code = EXIT_ABSENT_LOCAL_REF;
+    return 0;
+  }
+  if (resolved == 1 && git_oid_fromstr(&repo_context->head_oid_buffer, head_oid_hex) == 0) {
+    snprintf(repo_context->branch_buffer, sizeof(repo_context->branch_buffer), "%s", shortenRefName(head_name));
+    repo_context->head_oid = &repo_context->head_oid_buffer;
+    return 1;
+  }
+
   git_reference *head_ref = NULL;
   const git_oid *head_oid;
   if (git_repository_head(&head_ref, repo_context->repo_obj) != 0) {
@@ -697,6 +1471,7 @@ int getRepoHeadRef(struct RepoContext *repo_context) {
     return 0;
   }
   head_oid = git_reference_target(head_ref);
+  snprintf(repo_context->branch_buffer, sizeof(repo_context->branch_buffer), "%s", git_reference_shorthand(head_ref));
 
   repo_context->head_ref = head_ref;
   repo_context->head_oid = head_oid;
@@ -715,14 +1490,21 @@ int getRepoHeadRef(struct RepoContext *repo_context) {
  */
 void extractRepoAndBranchNames(struct RepoContext *repo_context) {
   repo_context->repo_name = strrchr(repo_context->repo_path, '/') + 1;
-  repo_context->branch_name = git_reference_shorthand(repo_context->head_ref);
+  repo_context->branch_name = repo_context->branch_buffer;
 }
 
 
 /**
- * Iterates through each element in the repo to determine their status
- * relative to the index and working directory. Also tallies any
- * conflicts.
+ * Determines the staged and unstaged state of the repo and tallies any
+ * conflicts. The HEAD->index and index->workdir diffs are streamed
+ * through countStatusDelta(), which only keeps running counters, so
+ * memory use does not grow with the number of changed files. Each
+ * pass stops at its first change.
+ *
+ * The index is parsed natively first (see loadNativeIndex()). Its
+ * cache tree, when valid, tells whether anything is staged, and
+ * checkWorkdirNative() usually settles the working directory, so in a
+ * clean repo libgit2 never loads the index at all.
  *
  * @param repo_context: Pointer to the RepoContext structure. Upon
  *                     completion, this structure will reflect the
@@ -730,138 +1512,2208 @@ void extractRepoAndBranchNames(struct RepoContext *repo_context) {
  *                     statuses.
  */
 void setupAndRetrieveGitStatus(struct RepoContext *repo_context) {
+  struct CostReport *report = repo_context->cost_report;
+  struct NativeIndex native;
+  char index_path[MAX_PATH_BUFFER_SIZE];
+  snprintf(index_path, sizeof(index_path), "%sindex", git_repository_path(repo_context->repo_obj));
+  const int have_native = loadNativeIndex(index_path, &native);
+  markCostPhase(report, COST_PARSE);
+  if (report && have_native) report->index_blocks = native.block_count;
+
+  // HEAD is already resolved; passing its tree keeps libgit2 from
+  // resolving it again (and loading all of packed-refs to do so)
+  git_tree   *head_tree   = NULL;
+  git_commit *head_commit = NULL;
+  git_oid     head_tree_id = {{0}};
+  if (git_commit_lookup(&head_commit, repo_context->repo_obj, repo_context->head_oid) == 0) {
+    git_oid_cpy(&head_tree_id, git_commit_tree_id(head_commit));
+    git_commit_tree(&head_tree, head_commit);
+    git_commit_free(head_commit);
+  }
+  markCostPhase(report, COST_STAGED);
+
+  struct StatusPass staged   = {1, 0, report, 0};
+  struct StatusPass unstaged = {0, 0, report, 0};
+  int staged_checked  = 0;
+  int workdir_checked = 0;
+  int error = 0;
+
+  if (have_native) {
+    repo_context->conflict_count = countNativeConflicts(&native);
+
+    // a valid cache tree is the tree the index would be written as;
+    // intent-to-add entries are left out of it, but not out of the diff
+    staged_checked = head_tree && native.has_cache_tree && !native.intent_to_add &&
+                     git_oid_equal(&native.cache_tree_id, &head_tree_id);
+
+    workdir_checked = checkWorkdirNative(repo_context, native.entries, native.entry_count,
+                                         &native.file_stat, &unstaged.changes);
+    markCostPhase(report, COST_WORKDIR);
+  }
+
+  git_index *index = NULL;
+  if (!staged_checked || !workdir_checked) {
+    if (git_repository_index(&index, repo_context->repo_obj) != 0) {
+      // resources are released by cleanupResources(); the divergence
+      // phase may still be using repo_path
+      if (have_native) freeNativeIndex(&native);
+      git_tree_free(head_tree);
+      repo_context->exit_code = EXIT_FAIL_GIT_STATUS;
+      return;
+    }
+    markCostPhase(report, COST_INDEX);
+
+    // conflicts are read straight from the index, one per conflicted path
+    git_index_conflict_iterator *conflicts = NULL;
+    if (!have_native && git_index_conflict_iterator_new(&conflicts, index) == 0) {
+      const git_index_entry *ancestor, *ours, *theirs;
+      while (git_index_conflict_next(&ancestor, &ours, &theirs, conflicts) == 0) {
+        repo_context->conflict_count++;
+      }
+      git_index_conflict_iterator_free(conflicts);
+    }
+  }
+  if (have_native) freeNativeIndex(&native);
+
   // Suppressing this warning due to a known issue with
-  // GIT_STATUS_OPTIONS_INIT not initializing all fields. We're
+  // GIT_DIFF_OPTIONS_INIT not initializing all fields. We're
   // manually setting the necessary fields afterwards.
   #pragma GCC diagnostic push
   #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
-  git_status_options opts = GIT_STATUS_OPTIONS_INIT;
+  git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
   #pragma GCC diagnostic pop
-  opts.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
-  opts.flags = GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX;
+  opts.flags     = GIT_DIFF_INCLUDE_TYPECHANGE;
+  opts.notify_cb = countStatusDelta;
+
+  // the callbacks reject every delta, so the diffs stay empty; GIT_EUSER
+  // only means a pass stopped early
+  git_diff *diff = NULL;
+  if (!staged_checked) {
+    opts.payload = &staged;
+    error = git_diff_tree_to_index(&diff, repo_context->repo_obj, head_tree, index, &opts);
+    git_diff_free(diff);
+    diff = NULL;
+  }
+  markCostPhase(report, COST_STAGED);
+
+  // the working directory can usually be checked without libgit2's diff
+  if ((error == 0 || error == GIT_EUSER) && !workdir_checked && !have_native)
+    workdir_checked = checkWorkdirWithIndex(repo_context, index, &unstaged.changes);
+
+  if ((error == 0 || error == GIT_EUSER) && !workdir_checked) {
+    opts.payload = &unstaged;
+    if (report) {
+      // the root directory is read before the first path comes through
+      report->last_directory = findDirectoryCost(report, ".") - report->directories;
+      clock_gettime(CLOCK_MONOTONIC, &report->last_progress);
+      opts.progress_cb = recordWorkdirProgress;
+    }
+    error = git_diff_index_to_workdir(&diff, repo_context->repo_obj, index, &opts);
+    git_diff_free(diff);
+    recordWorkdirProgress(NULL, NULL, NULL, &unstaged);
+  }
+  markCostPhase(report, COST_WORKDIR);
 
-  int staged_changes   = 0;
-  int unstaged_changes = 0;
+  git_tree_free(head_tree);
+  git_index_free(index);
 
-  git_status_list *status_list = NULL;
-  if (git_status_list_new(&status_list, repo_context->repo_obj, &opts) != 0) {
-    git_reference_free(repo_context->head_ref);
-    git_repository_free(repo_context->repo_obj);
-    free((void *) repo_context->repo_path);
+  if (error != 0 && error != GIT_EUSER) {
     repo_context->exit_code = EXIT_FAIL_GIT_STATUS;
     return;
   }
 
-  int status_count = git_status_list_entrycount(status_list);
-  for (int i = 0; i < status_count; i++) {
-    const git_status_entry *entry = git_status_byindex(status_list, i);
-    if (entry->status == GIT_STATUS_CURRENT) continue;
-
-    if (entry->status & GIT_STATUS_CONFLICTED)       repo_context->conflict_count++;
-
-    // Check for staged changes
-    if (entry->status & (GIT_STATUS_INDEX_NEW      |
-                         GIT_STATUS_INDEX_MODIFIED |
-                         GIT_STATUS_INDEX_RENAMED  |
-                         GIT_STATUS_INDEX_DELETED  |
-                         GIT_STATUS_INDEX_TYPECHANGE)) {
-      repo_context->s_index = MODIFIED;
-      staged_changes++;
-    }
-
-    // Check for unstaged changes 
-    if (entry->status & (GIT_STATUS_WT_MODIFIED |
-                         GIT_STATUS_WT_DELETED  |
-                         GIT_STATUS_WT_RENAMED  |
-                         GIT_STATUS_WT_TYPECHANGE)) {
-      repo_context->s_wdir = MODIFIED;
-      unstaged_changes++;
-    }
-}
-
-  repo_context->status_list = status_list;
-  repo_context->staged_changes = staged_changes;
-  repo_context->unstaged_changes = unstaged_changes;
+  if (staged.changes)   repo_context->s_index = MODIFIED;
+  if (unstaged.changes) repo_context->s_wdir  = MODIFIED;
+  repo_context->staged_changes   = staged.changes;
+  repo_context->unstaged_changes = unstaged.changes;
 }
 
 
 /**
- * Checks if the current repository is in the middle of an interactive
- * rebase operation by looking for the presence of 'rebase-merge' or
- * 'rebase-apply' directories in the '.git' folder.
+ * Diff notify callback for setupAndRetrieveGitStatus(). Counts deltas
+ * which libgit2's status would report as staged (INDEX_*) or unstaged
+ * (WT_*) changes and rejects every delta, so nothing is kept in the
+ * diff.
  *
- * @param repo_context: Pointer to the RepoContext structure. The
- *                     'rebase_in_progress' flag will be set to 1 if
- *                     an interactive rebase is in progress.
+ * @param diff: The diff being built (unused).
+ * @param delta: The delta about to be added.
+ * @param matched_pathspec: The pathspec which matched (unused).
+ * @param payload: The StatusPass for this diff.
+ *
+ * @return: 1 to skip the delta, or GIT_EUSER to stop the pass once the
+ *          first change is found. A census pass never stops.
  */
-void checkForInteractiveRebase(struct RepoContext *repo_context) {
-  char rebaseMergePath[MAX_PATH_BUFFER_SIZE];
-  char rebaseApplyPath[MAX_PATH_BUFFER_SIZE];
-  snprintf(rebaseMergePath, sizeof(rebaseMergePath), "%s/.git/rebase-merge", repo_context->repo_path);
-  snprintf(rebaseApplyPath, sizeof(rebaseApplyPath), "%s/.git/rebase-apply", repo_context->repo_path);
+int countStatusDelta(const git_diff *diff,
+                     const git_diff_delta *delta,
+                     const char *matched_pathspec,
+                     void *payload) {
+  (void) diff;
+  (void) matched_pathspec;
+  struct StatusPass *pass = payload;
+  struct CostReport *report = pass->cost_report;
+
+  if (pass->census) {
+    const char *path = delta->new_file.path ?: delta->old_file.path;
+    if (delta->status == GIT_DELTA_UNTRACKED || delta->status == GIT_DELTA_IGNORED)
+      findDirectoryCost(report, path)->ignore_checks++;
+    if (pass->staged && delta->status == GIT_DELTA_ADDED)   report->staged_adds++;
+    if (pass->staged && delta->status == GIT_DELTA_DELETED) report->staged_deletes++;
+    return 1;
+  }
 
-  struct stat mergeStat, applyStat;
-  if (stat(rebaseMergePath, &mergeStat) == 0 || stat(rebaseApplyPath, &applyStat) == 0) {
-    repo_context->rebase_in_progress = 1;
+  int counted = 0;
+  switch (delta->status) {
+    case GIT_DELTA_MODIFIED:
+    case GIT_DELTA_DELETED:
+    case GIT_DELTA_RENAMED:
+    case GIT_DELTA_TYPECHANGE:
+      counted = 1;
+      break;
+    case GIT_DELTA_ADDED:
+    case GIT_DELTA_COPIED:
+      // new files are only changes once they are in the index
+      counted = pass->staged;
+      break;
+    default:
+      break;
   }
+  if (!counted) return 1;
+
+  pass->changes++;
+  return GIT_EUSER;
 }
 
 
 /**
- * Inspects the repository to detect if there are any conflicts or
- * divergence between the local and remote branches. It sets the
- * 's_repo' state of the RepoContext structure based on the findings
- * (e.g., CONFLICT, NO_DATA, UP_TO_DATE, MODIFIED).
+ * Checks the working directory against the index the way git's index
+ * refresh does, instead of running libgit2's index->workdir diff: every
+ * tracked file is lstat'ed, and only files whose stat data does not
+ * match the index (or which are as new as the index itself, i.e.
+ * racily clean) are hashed, on a pool of threads. Stops at the first
+ * file which has certainly changed.
  *
- * @param repo_context: Pointer to the RepoContext structure. This will
- *                     be updated with conflict and divergence
- *                     information.
+ * Files which hash the same get their stat data refreshed in the
+ * in-memory index if libgit2's diff runs next, and patched into
+ * .git/index if GP_REFRESH_INDEX is set, so later prompts don't hash
+ * them again.
+ *
+ * Anything this doesn't handle exactly like libgit2 (submodules,
+ * sparse or intent-to-add entries, non-default core.* settings,
+ * content with filters applied) is handed back.
+ *
+ * @param repo_context: Pointer to the RepoContext structure.
+ * @param entries:      The index entries, sorted as in the index.
+ * @param entry_count:  Number of entries.
+ * @param index_stat:   stat() data of the index file the entries were
+ *                      read from.
+ * @param changes:      Set to 1 if there are unstaged changes, 0 if
+ *                      not. Only valid when 1 is returned.
+ *
+ * @return: 1 if the working directory was checked, 0 if the caller has
+ *          to run libgit2's diff instead.
  */
-void checkForConflictsAndDivergence(struct RepoContext *repo_context) {
-  if (repo_context->conflict_count != 0) {
-    // If we're in conflict, mark the repo state accordingly.
-    repo_context->s_repo = CONFLICT;
+int checkWorkdirNative(struct RepoContext *repo_context,
+                       const git_index_entry *entries,
+                       size_t entry_count,
+                       const struct stat *index_stat,
+                       int *changes) {
+  const char *workdir = git_repository_workdir(repo_context->repo_obj);
+  if (!workdir) return 0;
+
+  // the diff would behave differently with any of these changed
+  git_config *config = NULL;
+  int filemode = 1, symlinks = 1, trustctime = 1, ignorestat = 0;
+  if (git_repository_config_snapshot(&config, repo_context->repo_obj) != 0) return 0;
+  git_config_get_bool(&filemode,   config, "core.filemode");
+  git_config_get_bool(&symlinks,   config, "core.symlinks");
+  git_config_get_bool(&trustctime, config, "core.trustctime");
+  git_config_get_bool(&ignorestat, config, "core.ignorestat");
+  git_config_free(config);
+  if (!filemode || !symlinks || ignorestat) return 0;
+
+  struct HashCandidate *candidates = NULL;
+  size_t candidate_count    = 0;
+  size_t candidate_capacity = 0;
+  int    uncertain          = 0;
+  int    modified           = 0;
+  long   racy_count         = 0;
+
+  // --explain-cost attributes the stat calls to directories, like it
+  // does for libgit2's diff
+  struct CostReport *report   = repo_context->cost_report;
+  struct StatusPass  progress = {0, 0, report, 0};
+  if (report) {
+    report->last_directory = -1;
+    clock_gettime(CLOCK_MONOTONIC, &report->last_progress);
   }
-  else {
-    char full_remote_branch_name[128];
-    sprintf(full_remote_branch_name, "refs/remotes/origin/%s", git_reference_shorthand(repo_context->head_ref));
 
-    // If there is no upstream ref, this is probably a stand-alone branch
-    git_reference *upstream_ref = NULL;
-    const git_oid *upstream_oid;
+  char path[MAX_PATH_BUFFER_SIZE];
+  for (size_t i = 0; i < entry_count && !modified; i++) {
+    const git_index_entry *entry = &entries[i];
 
-    const int retval = git_reference_lookup(&upstream_ref, repo_context->repo_obj, full_remote_branch_name);
-    if (retval != 0) {
-      git_reference_free(upstream_ref);
-      repo_context->s_repo = NO_DATA;
+    // conflicts are counted on their own, not as unstaged changes
+    if (git_index_entry_stage(entry) != 0) continue;
+
+    if (entry->mode == GIT_FILEMODE_COMMIT ||
+        (entry->flags_extended & (GIT_INDEX_ENTRY_INTENT_TO_ADD | GIT_INDEX_ENTRY_SKIP_WORKTREE))) {
+      uncertain = 1;
+      continue;
     }
-    else {
-      upstream_oid = git_reference_target(upstream_ref);
-
-      // if the upstream_oid is null, we can't get the divergence, so
-      // might as well set it to NO_DATA. Oh and btw, when there's no
-      // conflict _and_ upstream_OID is NULL, then it seems we're
-      // inside of an interactive rebase - when it's not useful to
-      // check for divergences anyway.
-      if (upstream_oid == NULL) {
-        repo_context->s_repo = NO_DATA;
+
+    struct stat file_stat;
+    const int length = snprintf(path, sizeof(path), "%s%s", workdir, entry->path);
+    if (length < 0 || (size_t) length >= sizeof(path)) {
+      uncertain = 1;
+      continue;
+    }
+    if (report) recordWorkdirProgress(NULL, NULL, entry->path, &progress);
+    if (lstat(path, &file_stat) != 0) {
+      if (errno == ENOENT || errno == ENOTDIR) modified = 1;
+      else uncertain = 1;
+      continue;
+    }
+
+    const uint32_t mode = S_ISLNK(file_stat.st_mode)    ? GIT_FILEMODE_LINK :
+                          !S_ISREG(file_stat.st_mode)   ? 0 :
+                          (file_stat.st_mode & S_IXUSR) ? GIT_FILEMODE_BLOB_EXECUTABLE :
+                                                          GIT_FILEMODE_BLOB;
+    if (mode != entry->mode) {
+      modified = 1;
+      continue;
+    }
+
+    // same checks, in the same order, as libgit2's diff
+    if ((uint32_t) file_stat.st_size != entry->file_size) {
+      if (entry->file_size != 0) {
+        modified = 1;
+        continue;
       }
-      else {
-        calculateDivergence(repo_context->repo_obj,
-                            repo_context->head_oid,
-                            upstream_oid,
-                            &repo_context->ahead,
-                            &repo_context->behind);
+    }
+    else if (entry->mtime.seconds == (int32_t) GP_STAT_MTIME(file_stat).tv_sec            &&
+             entry->mtime.nanoseconds == (uint32_t) GP_STAT_MTIME(file_stat).tv_nsec      &&
+             (!trustctime ||
+              (entry->ctime.seconds == (int32_t) GP_STAT_CTIME(file_stat).tv_sec          &&
+               entry->ctime.nanoseconds == (uint32_t) GP_STAT_CTIME(file_stat).tv_nsec))  &&
+             entry->ino == (uint32_t) file_stat.st_ino                                    &&
+             entry->uid == (uint32_t) file_stat.st_uid                                    &&
+             entry->gid == (uint32_t) file_stat.st_gid) {
+      if (GP_STAT_MTIME(file_stat).tv_sec < GP_STAT_MTIME(*index_stat).tv_sec ||
+          (GP_STAT_MTIME(file_stat).tv_sec == GP_STAT_MTIME(*index_stat).tv_sec &&
+           GP_STAT_MTIME(file_stat).tv_nsec < GP_STAT_MTIME(*index_stat).tv_nsec)) {
+        continue;
       }
+      // unchanged stat data, but the file may have changed in the same
+      // timestamp tick as the index was written
+      racy_count++;
+    }
 
+    if (candidate_count == candidate_capacity) {
+      candidate_capacity = candidate_capacity ? candidate_capacity * 2 : 64;
+      struct HashCandidate *grown = realloc(candidates, candidate_capacity * sizeof(*grown));
+      if (!grown) {
+        free(candidates);
+        return 0;
+      }
+      candidates = grown;
     }
+    candidates[candidate_count].entry     = entry;
+    candidates[candidate_count].file_stat = file_stat;
+    candidates[candidate_count].result    = HASH_PENDING;
+    candidate_count++;
+  }
 
-    // check if local and remote are the same
-    if (repo_context->s_repo == UP_TO_DATE) {
-      if (git_oid_cmp(repo_context->head_oid, upstream_oid) != 0)
-        repo_context->s_repo = MODIFIED;
+  if (report) {
+    recordWorkdirProgress(NULL, NULL, NULL, &progress);
+    markCostPhase(report, COST_WORKDIR);
+  }
+
+  if (modified) {
+    free(candidates);
+    if (report) report->workdir_decided = 1;
+    *changes = 1;
+    return 1;
+  }
+
+  hashCandidates(workdir, candidates, candidate_count);
+
+  if (report) {
+    markCostPhase(report, COST_HASH);
+    for (size_t i = 0; i < candidate_count; i++) {
+      struct DirectoryCost *directory = findDirectoryCost(report, candidates[i].entry->path);
+      directory->hashed_files++;
+      directory->hashed_bytes += candidates[i].file_stat.st_size;
     }
+    report->racy_entries         += racy_count;
+    report->stat_changed_entries += candidate_count - racy_count;
+  }
 
-    git_reference_free(upstream_ref);
+  // matches are all checked, they must not be refreshed if filters apply
+  for (size_t i = 0; i < candidate_count; i++) {
+    struct HashCandidate *candidate = &candidates[i];
+    git_filter_list *filters = NULL;
+    if (modified && candidate->result != HASH_MATCH) continue;
+
+    // a clean filter (e.g. ident or a custom one) may turn the same
+    // bytes into a different blob
+    if (candidate->result == HASH_MATCH) {
+      if (S_ISLNK(candidate->file_stat.st_mode)) continue;
+      if (git_filter_list_load(&filters, repo_context->repo_obj, NULL, candidate->entry->path,
+                               GIT_FILTER_TO_ODB, GIT_FILTER_DEFAULT) != 0 || filters) {
+        git_filter_list_free(filters);
+        candidate->result = HASH_FILTERED;
+        uncertain = 1;
+      }
+    }
+    else if (candidate->result != HASH_MISMATCH) {
+      uncertain = 1;
+    }
+    // the bytes differ, but filters (e.g. CRLF) may still make the
+    // blob the same; only libgit2 can tell then
+    else if (!S_ISLNK(candidate->file_stat.st_mode) &&
+             git_filter_list_load(&filters, repo_context->repo_obj, NULL, candidate->entry->path,
+                                  GIT_FILTER_TO_ODB, GIT_FILTER_DEFAULT) != 0) {
+      uncertain = 1;
+    }
+    else if (filters) {
+      git_filter_list_free(filters);
+      uncertain = 1;
+    }
+    else {
+      modified = 1;
+    }
   }
+
+  // the refreshed stat data only matters to libgit2's diff if it runs
+  // next, or to later prompts if it is written back
+  if (candidate_count && uncertain && !modified)
+    refreshIndexEntries(repo_context, candidates, candidate_count, index_stat);
+  if (candidate_count && getenv("GP_REFRESH_INDEX")) {
+    snprintf(path, sizeof(path), "%sindex", git_repository_path(repo_context->repo_obj));
+    writeIndexStatData(path, entries, entry_count, candidates, candidate_count, index_stat);
+  }
+
+  // otherwise libgit2's diff runs next, and estimateHashCost() adds
+  // what it hashes on top (the matches refreshed above it won't)
+  if (report && (modified || !uncertain)) report->workdir_decided = 1;
+  free(candidates);
+
+  if (modified) {
+    *changes = 1;
+    return 1;
+  }
+  if (uncertain) return 0;
+
+  *changes = 0;
+  return 1;
+}
+
+
+/**
+ * Runs checkWorkdirNative() on an index loaded by libgit2, for when the
+ * index could not be parsed natively.
+ *
+ * @param repo_context: Pointer to the RepoContext structure.
+ * @param index:        The repository's index.
+ * @param changes:      See checkWorkdirNative().
+ *
+ * @return: See checkWorkdirNative().
+ */
+int checkWorkdirWithIndex(struct RepoContext *repo_context, git_index *index, int *changes) {
+  struct stat index_stat;
+  if (stat(git_index_path(index), &index_stat) != 0) return 0;
+
+  // the copies share their paths with the index, which outlives them
+  const size_t entry_count = git_index_entrycount(index);
+  git_index_entry *entries = malloc((entry_count ? entry_count : 1) * sizeof(*entries));
+  if (!entries) return 0;
+  for (size_t i = 0; i < entry_count; i++) entries[i] = *git_index_get_byindex(index, i);
+
+  const int checked = checkWorkdirNative(repo_context, entries, entry_count, &index_stat, changes);
+  free(entries);
+  return checked;
+}
+
+
+/**
+ * Records the current stat data of hashed files which turned out
+ * unchanged in libgit2's (shared, in-memory) index, so its diff doesn't
+ * hash them again.
+ *
+ * Nothing is recorded if the index file changed since the entries were
+ * read from it; they could undo someone else's update.
+ *
+ * @param repo_context: Pointer to the RepoContext structure.
+ * @param candidates:   The hashed candidates.
+ * @param count:        Number of candidates.
+ * @param index_stat:   stat() data of the index file the candidates'
+ *                      entries were read from.
+ */
+void refreshIndexEntries(struct RepoContext *repo_context,
+                         const struct HashCandidate *candidates,
+                         size_t count,
+                         const struct stat *index_stat) {
+  git_index *index = NULL;
+  if (git_repository_index(&index, repo_context->repo_obj) != 0) return;
+
+  struct stat current_stat;
+  if (stat(git_index_path(index), &current_stat) == 0                          &&
+      GP_STAT_MTIME(current_stat).tv_sec  == GP_STAT_MTIME(*index_stat).tv_sec  &&
+      GP_STAT_MTIME(current_stat).tv_nsec == GP_STAT_MTIME(*index_stat).tv_nsec &&
+      current_stat.st_size                == index_stat->st_size                &&
+      current_stat.st_ino                 == index_stat->st_ino) {
+    for (size_t i = 0; i < count; i++) {
+      const struct HashCandidate *candidate = &candidates[i];
+      if (candidate->result != HASH_MATCH) continue;
+
+      git_index_entry refreshed_entry   = *candidate->entry;
+      const struct stat *file_stat      = &candidate->file_stat;
+      refreshed_entry.ctime.seconds     = GP_STAT_CTIME(*file_stat).tv_sec;
+      refreshed_entry.ctime.nanoseconds = GP_STAT_CTIME(*file_stat).tv_nsec;
+      refreshed_entry.mtime.seconds     = GP_STAT_MTIME(*file_stat).tv_sec;
+      refreshed_entry.mtime.nanoseconds = GP_STAT_MTIME(*file_stat).tv_nsec;
+      refreshed_entry.dev               = file_stat->st_dev;
+      refreshed_entry.ino               = file_stat->st_ino;
+      refreshed_entry.uid               = file_stat->st_uid;
+      refreshed_entry.gid               = file_stat->st_gid;
+      refreshed_entry.file_size         = file_stat->st_size;
+      git_index_add(index, &refreshed_entry);
+    }
+  }
+  git_index_free(index);
+}
+
+
+/**
+ * Hashes HashCandidates as git blobs and compares them with their index
+ * entries, on up to MAX_HASH_THREADS threads (one per CPU). Threads
+ * claim candidates one at a time, so a few large files don't hold up
+ * the rest.
+ *
+ * @param workdir:    The working directory, ending with a '/'.
+ * @param candidates: The candidates. Their 'result' is filled in.
+ * @param count:      Number of candidates.
+ */
+void hashCandidates(const char *workdir, struct HashCandidate *candidates, size_t count) {
+  if (count == 0) return;
+
+  struct HashJob job = {
+    .workdir    = workdir,
+    .candidates = candidates,
+    .count      = count,
+    .next       = 0,
+    .compress   = selectSha1Compress(),
+  };
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t thread_count = cpus > 0 ? (size_t) cpus : 1;
+  if (thread_count > MAX_HASH_THREADS) thread_count = MAX_HASH_THREADS;
+  if (thread_count > count)            thread_count = count;
+
+  struct Task tasks[MAX_HASH_THREADS];
+  for (size_t i = 0; i < thread_count; i++) {
+    tasks[i].run      = runHashTask;
+    tasks[i].argument = &job;
+  }
+  runTasks(tasks, thread_count);
+}
+
+
+/**
+ * Task for hashCandidates(): hashes candidates until none are left.
+ *
+ * @param argument: The shared HashJob.
+ */
+void runHashTask(void *argument) {
+  struct HashJob *job = argument;
+  unsigned char *buffer = malloc(HASH_READ_BUFFER_SIZE);
+  char path[MAX_PATH_BUFFER_SIZE];
+
+  for (;;) {
+    const size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->count) break;
+
+    struct HashCandidate *candidate = &job->candidates[i];
+    unsigned char digest[GIT_OID_RAWSZ];
+    snprintf(path, sizeof(path), "%s%s", job->workdir, candidate->entry->path);
+
+    if (!buffer || !hashWorkdirFile(path, &candidate->file_stat, buffer, job->compress, digest))
+      candidate->result = HASH_FAILED;
+    else if (memcmp(digest, candidate->entry->id.id, GIT_OID_RAWSZ) == 0)
+      candidate->result = HASH_MATCH;
+    else
+      candidate->result = HASH_MISMATCH;
+  }
+
+  free(buffer);
+}
+
+
+/**
+ * Hashes a working-directory file as a git blob ("blob <size>\0" and
+ * the contents; for symlinks the contents are the link target), with
+ * large sequential reads. Fails if the file no longer has the size it
+ * had when it was lstat'ed.
+ *
+ * @param path:      Full path of the file.
+ * @param file_stat: The lstat() data for the file.
+ * @param buffer:    Scratch buffer of HASH_READ_BUFFER_SIZE bytes.
+ * @param compress:  The SHA-1 block function to use.
+ * @param digest:    Output, the blob's object id.
+ *
+ * @return: 1 on success, 0 on failure.
+ */
+int hashWorkdirFile(const char *path,
+                    const struct stat *file_stat,
+                    unsigned char *buffer,
+                    Sha1Compress compress,
+                    unsigned char digest[GIT_OID_RAWSZ]) {
+  struct Sha1Context context;
+  sha1Init(&context, compress);
+
+  char header[64];
+  const int header_length = snprintf(header, sizeof(header), "blob %lld", (long long) file_stat->st_size);
+  sha1Update(&context, header, header_length + 1);
+
+  if (S_ISLNK(file_stat->st_mode)) {
+    const ssize_t length = readlink(path, (char *) buffer, HASH_READ_BUFFER_SIZE);
+    if (length != file_stat->st_size) return 0;
+    sha1Update(&context, buffer, length);
+    sha1Final(&context, digest);
+    return 1;
+  }
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0) return 0;
+#ifdef POSIX_FADV_SEQUENTIAL
+  // not available on macOS
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  long long total = 0;
+  ssize_t   length;
+  while ((length = read(fd, buffer, HASH_READ_BUFFER_SIZE)) > 0) {
+    sha1Update(&context, buffer, length);
+    total += length;
+  }
+  close(fd);
+  if (length < 0 || total != (long long) file_stat->st_size) return 0;
+
+  sha1Final(&context, digest);
+  return 1;
+}
+
+
+/**
+ * Checks if the current repository is in the middle of an interactive
+ * rebase operation by looking for the presence of 'rebase-merge' or
+ * 'rebase-apply' directories in the '.git' folder.
+ *
+ * @param repo_context: Pointer to the RepoContext structure. The
+ *                     'rebase_in_progress' flag will be set to 1 if
+ *                     an interactive rebase is in progress.
+ */
+void checkForInteractiveRebase(struct RepoContext *repo_context) {
+  char rebaseMergePath[MAX_PATH_BUFFER_SIZE];
+  char rebaseApplyPath[MAX_PATH_BUFFER_SIZE];
+  snprintf(rebaseMergePath, sizeof(rebaseMergePath), "%s/.git/rebase-merge", repo_context->repo_path);
+  snprintf(rebaseApplyPath, sizeof(rebaseApplyPath), "%s/.git/rebase-apply", repo_context->repo_path);
+
+  struct stat mergeStat, applyStat;
+  if (stat(rebaseMergePath, &mergeStat) == 0 || stat(rebaseApplyPath, &applyStat) == 0) {
+    repo_context->rebase_in_progress = 1;
+  }
+}
+
+
+/**
+ * Inspects the repository to detect if there are any conflicts or
+ * divergence between the local and remote branches. It sets the
+ * 's_repo' state of the RepoContext structure based on the findings
+ * (e.g., CONFLICT, NO_DATA, UP_TO_DATE, MODIFIED).
+ *
+ * @param repo_context: Pointer to the RepoContext structure. This will
+ *                     be updated with conflict and divergence
+ *                     information.
+ */
+void checkForConflictsAndDivergence(struct RepoContext *repo_context) {
+  if (repo_context->conflict_count != 0) {
+    // If we're in conflict, mark the repo state accordingly.
+    repo_context->s_repo = CONFLICT;
+  }
+  else {
+    checkForDivergence(repo_context, repo_context->repo_obj);
+  }
+}
+
+
+/**
+ * Looks up refs/remotes/origin/<branch> and calculates how far HEAD
+ * has diverged from it, setting 's_repo' to NO_DATA, UP_TO_DATE or
+ * MODIFIED. If 'divergence_targets' is set, the divergence_targets
+ * are looked up too, and all of them are counted in the same walk (see
+ * countDivergence()); if the walk fails, 's_repo' is NO_DATA and no
+ * target is found. Only reads from repo_context, apart from
+ * 's_repo', 'ahead', 'behind', 'revwalk_commits' and 'targets', so it
+ * can run next to the status phase.
+ *
+ * @param repo_context: Pointer to the RepoContext structure.
+ * @param repo:         The repository handle to use.
+ */
+void checkForDivergence(struct RepoContext *repo_context, git_repository *repo) {
+  char full_remote_branch_name[MAX_BRANCH_BUFFER_SIZE + 32];
+  snprintf(full_remote_branch_name, sizeof(full_remote_branch_name), "refs/remotes/origin/%s", repo_context->branch_name);
+
+  // the tips to walk from, and which of them belongs to what
+  git_oid tips[1 + DIVERGENCE_TARGET_COUNT];
+  int     target_tips[DIVERGENCE_TARGET_COUNT];
+  int     tip_count  = 0;
+  int     origin_tip = -1;
+
+  // If there is no upstream ref, this is probably a stand-alone branch
+  if (resolveDivergenceTip(repo, full_remote_branch_name, &tips[tip_count])) {
+    origin_tip = tip_count++;
+  }
+  else {
+    repo_context->s_repo = NO_DATA;
+  }
+
+  for (int i = 0; i < DIVERGENCE_TARGET_COUNT; i++) {
+    char target_name[MAX_BRANCH_BUFFER_SIZE + 32];
+    target_tips[i] = -1;
+    if (repo_context->divergence_targets &&
+        findDivergenceTarget(repo_context, repo, i, target_name, sizeof(target_name)) &&
+        resolveDivergenceTip(repo, target_name, &tips[tip_count])) {
+      target_tips[i] = tip_count++;
+    }
+  }
+
+  int ahead[1 + DIVERGENCE_TARGET_COUNT];
+  int behind[1 + DIVERGENCE_TARGET_COUNT];
+  if (tip_count > 0) {
+    const int walked = countDivergence(repo, repo_context->head_oid, tips, tip_count, ahead, behind);
+    repo_context->revwalk_commits = walked > 0 ? walked : 0;
+
+    // the counts are unknown then, not 0
+    if (walked < 0) {
+      repo_context->s_repo = NO_DATA;
+      origin_tip = -1;
+      for (int i = 0; i < DIVERGENCE_TARGET_COUNT; i++) target_tips[i] = -1;
+    }
+  }
+
+  if (origin_tip >= 0) {
+    repo_context->ahead  = ahead[origin_tip];
+    repo_context->behind = behind[origin_tip];
+
+    // check if local and remote are the same
+    if (repo_context->s_repo == UP_TO_DATE &&
+        git_oid_cmp(repo_context->head_oid, &tips[origin_tip]) != 0) {
+      repo_context->s_repo = MODIFIED;
+    }
+  }
+
+  for (int i = 0; i < DIVERGENCE_TARGET_COUNT; i++) {
+    const int tip = target_tips[i];
+    repo_context->targets[i].found  = tip >= 0;
+    repo_context->targets[i].ahead  = tip >= 0 ? ahead[tip]  : 0;
+    repo_context->targets[i].behind = tip >= 0 ? behind[tip] : 0;
+  }
+}
+
+
+/**
+ * Finds the full ref name of one of the divergence_targets:
+ *
+ * - TARGET_UPSTREAM: what branch.<name>.remote and branch.<name>.merge
+ *   point at, i.e. @{upstream}.
+ * - TARGET_PUSH: refs/remotes/<remote>/<name>, where <remote> is
+ *   branch.<name>.pushRemote, remote.pushDefault, branch.<name>.remote
+ *   or origin, whichever is set first; the upstream if push.default is
+ *   upstream, and nothing if it is nothing. Unlike git's @{push}, the
+ *   remote's fetch refspec is assumed to be the default one.
+ * - TARGET_MAINLINE: GP_MAINLINE_REF.
+ *
+ * @param repo_context: Pointer to the RepoContext structure.
+ * @param repo:         The repository handle to use.
+ * @param target:       One of the divergence_targets.
+ * @param ref_name:     Output buffer for the ref name.
+ * @param size:         Size of 'ref_name'.
+ *
+ * @return Returns 1 if the target is configured, otherwise 0.
+ */
+int findDivergenceTarget(const struct RepoContext *repo_context,
+                         git_repository *repo,
+                         int target,
+                         char *ref_name,
+                         size_t size) {
+  if (target == TARGET_MAINLINE) {
+    const char *mainline = getMainlineRef();
+    return mainline && (size_t) snprintf(ref_name, size, "%s", mainline) < size;
+  }
+
+  // a detached HEAD has neither an upstream nor a push destination
+  const char *branch = repo_context->branch_name;
+  if (strcmp(branch, "HEAD") == 0) return 0;
+
+  git_config *config = NULL;
+  if (git_repository_config_snapshot(&config, repo) != 0) return 0;
+
+  const char *push_default = NULL;
+  git_config_get_string(&push_default, config, "push.default");
+  if (target == TARGET_PUSH && push_default &&
+      (strcmp(push_default, "upstream") == 0 || strcmp(push_default, "tracking") == 0)) {
+    target = TARGET_UPSTREAM;
+  }
+
+  int  found = 0;
+  char key[MAX_BRANCH_BUFFER_SIZE + 32];
+  if (target == TARGET_UPSTREAM) {
+    git_buf upstream = { 0 };
+    snprintf(key, sizeof(key), "refs/heads/%s", branch);
+    if (git_branch_upstream_name(&upstream, repo, key) == 0) {
+      found = (size_t) snprintf(ref_name, size, "%s", upstream.ptr) < size;
+    }
+    git_buf_dispose(&upstream);
+  }
+  else if (!push_default || strcmp(push_default, "nothing") != 0) {
+    const char *remote = NULL;
+    snprintf(key, sizeof(key), "branch.%s.pushRemote", branch);
+    if (git_config_get_string(&remote, config, key) != 0 &&
+        git_config_get_string(&remote, config, "remote.pushDefault") != 0) {
+      snprintf(key, sizeof(key), "branch.%s.remote", branch);
+      if (git_config_get_string(&remote, config, key) != 0) remote = "origin";
+    }
+    found = (size_t) snprintf(ref_name, size, "refs/remotes/%s/%s", remote, branch) < size;
+  }
+
+  git_config_free(config);
+  return found;
+}
+
+
+/**
+ * Resolves a ref to the commit a divergence is counted from. It is
+ * looked up natively, so that repos with huge packed-refs files only
+ * pay for a binary search; libgit2 is asked only if the native lookup
+ * can't parse something.
+ *
+ * A symbolic ref has no target of its own, so it counts as missing.
+ * (When there's no conflict and the upstream has no target, it seems
+ * we're inside of an interactive rebase, when divergence isn't useful
+ * anyway.)
+ *
+ * @param repo:     The repository handle to use.
+ * @param ref_name: Full name of the ref.
+ * @param oid:      Filled in with the commit on success.
+ *
+ * @return Returns 1 if the ref points to an object, otherwise 0.
+ */
+int resolveDivergenceTip(git_repository *repo, const char *ref_name, git_oid *oid) {
+  char resolved_name[MAX_BRANCH_BUFFER_SIZE];
+  char oid_hex[GIT_OID_HEXSZ + 1];
+
+  const int retval = resolveRefNative(git_repository_path(repo),
+                                      git_repository_commondir(repo),
+                                      ref_name,
+                                      resolved_name,
+                                      oid_hex);
+  if (retval == 1) {
+    return strcmp(resolved_name, ref_name) == 0 && git_oid_fromstr(oid, oid_hex) == 0;
+  }
+  if (retval == 0) return 0;
+
+  git_reference *ref = NULL;
+  int found = 0;
+  if (git_reference_lookup(&ref, repo, ref_name) == 0 && git_reference_target(ref)) {
+    git_oid_cpy(oid, git_reference_target(ref));
+    found = 1;
+  }
+  git_reference_free(ref);
+  return found;
+}
+
+
+/**
+ * Returns the ref \pm shows the divergence from: GP_MAINLINE_REF, or
+ * refs/remotes/upstream/main if it is unset.
+ *
+ * @return Returns the full ref name, or NULL if GP_MAINLINE_REF is set
+ *         to an empty string.
+ */
+const char *getMainlineRef(void) {
+  const char *mainline = getenv("GP_MAINLINE_REF") ?: DEFAULT_MAINLINE_REF;
+  return *mainline ? mainline : NULL;
+}
+
+
+/**
+ * Runs the working-tree status (bound on worktree I/O) and the
+ * divergence walk (bound on object and pack reads) at the same time,
+ * each on its own thread with its own repository handle, so that
+ * prompt latency is the slower of the two rather than their sum.
+ *
+ * The result is the same as setupAndRetrieveGitStatus() followed by
+ * checkForConflictsAndDivergence(): a conflict wins over whatever the
+ * divergence walk found. The walk is skipped if nothing in the prompt
+ * shows it.
+ *
+ * @param repo_context: Pointer to the RepoContext structure.
+ * @param needs:        The prompt_needs of the prompt pattern.
+ */
+void retrieveStatusAndDivergence(struct RepoContext *repo_context, int needs) {
+  struct Task tasks[] = {
+    { .run = runStatusTask,     .argument = repo_context },
+    { .run = runDivergenceTask, .argument = repo_context },
+  };
+
+  int task_count = 1;
+  if ((needs & NEEDS_DIVERGENCE) &&
+      git_repository_open(&repo_context->divergence_repo_obj, repo_context->repo_path) == 0) {
+    task_count = 2;
+  }
+  runTasks(tasks, task_count);
+
+  if (repo_context->conflict_count != 0) {
+    repo_context->s_repo = CONFLICT;
+    repo_context->ahead  = 0;
+    repo_context->behind = 0;
+    for (int i = 0; i < DIVERGENCE_TARGET_COUNT; i++) {
+      repo_context->targets[i].ahead  = 0;
+      repo_context->targets[i].behind = 0;
+    }
+  }
+  else if ((needs & NEEDS_DIVERGENCE) && task_count == 1) {
+    // no second handle, so walk after the status instead
+    checkForDivergence(repo_context, repo_context->repo_obj);
+  }
+}
+
+
+/**
+ * Task wrapper for setupAndRetrieveGitStatus().
+ *
+ * @param argument: Pointer to the RepoContext structure.
+ */
+void runStatusTask(void *argument) {
+  setupAndRetrieveGitStatus((struct RepoContext *) argument);
+}
+
+
+/**
+ * Task wrapper for checkForDivergence(), using the repository handle
+ * opened for it.
+ *
+ * @param argument: Pointer to the RepoContext structure.
+ */
+void runDivergenceTask(void *argument) {
+  struct RepoContext *repo_context = argument;
+  checkForDivergence(repo_context, repo_context->divergence_repo_obj);
+}
+
+
+/**
+ * Works out what the instructions in a prompt pattern need in order to
+ * be expanded. Names, the cwd, the prompt symbol and the rebase note
+ * can be read straight from the filesystem; everything else needs
+ * libgit2.
+ *
+ * @param prompt: The prompt pattern, typically GP_GIT_PROMPT.
+ *
+ * @return Returns a bitwise OR of prompt_needs flags. Zero means the
+ *         prompt only needs ref names.
+ */
+int getPromptNeeds(const char *prompt) {
+  const struct {
+    const char *instruction;
+    int         needs;
+  } instructions[] = {
+    { "\\pR", NEEDS_STATUS | NEEDS_DIVERGENCE                           },
+    { "\\pL", NEEDS_STATUS                                              },
+    { "\\pC", NEEDS_STATUS                                              },
+    { "\\pK", NEEDS_STATUS                                              },
+    { "\\pk", NEEDS_STATUS                                              },
+    { "\\pd", NEEDS_STATUS | NEEDS_DIVERGENCE                           },
+    { "\\pa", NEEDS_STATUS | NEEDS_DIVERGENCE                           },
+    { "\\pb", NEEDS_STATUS | NEEDS_DIVERGENCE                           },
+    { "\\pu", NEEDS_STATUS | NEEDS_DIVERGENCE | NEEDS_DIVERGENCE_TARGETS },
+    { "\\pw", NEEDS_STATUS | NEEDS_DIVERGENCE | NEEDS_DIVERGENCE_TARGETS },
+    { "\\pm", NEEDS_STATUS | NEEDS_DIVERGENCE | NEEDS_DIVERGENCE_TARGETS },
+    { "\\pP", NEEDS_STATUS                                              },
+  };
+
+  int needs = 0;
+  for (unsigned long i = 0; i < sizeof(instructions) / sizeof(instructions[0]); i++) {
+    if (strstr(prompt, instructions[i].instruction))
+      needs |= instructions[i].needs;
+  }
+  return needs;
+}
+
+
+/**
+ * Renders a prompt which only uses \pr, \pl, \pc, \pp and \pi. The git
+ * directory, HEAD and the ref it points to are read directly, so
+ * libgit2 is never initialized and the repository is never opened.
+ *
+ * Refs are looked up loose, in packed-refs or in a reftable stack (see
+ * lookupReftableRef()). Anything out of the ordinary (bare repos,
+ * unreadable refs, repos owned by someone else) is left to the libgit2
+ * path, so that both paths always agree.
+ *
+ * @param repo_context: Pointer to the RepoContext structure. Names,
+ *                     rebase state and exit_code are filled in.
+ *
+ * @return Returns 1 if a prompt was printed, or 0 if the caller should
+ *         fall back to libgit2.
+ */
+int printRefOnlyPrompt(struct RepoContext *repo_context) {
+  char repo_path[MAX_PATH_BUFFER_SIZE];
+  char git_dir[MAX_PATH_BUFFER_SIZE];
+
+  const int found = findGitDirectoryNative(repo_path, git_dir);
+  if (found < 0) return 0;
+  if (found == 0) {
+    printNonGitPrompt();
+    repo_context->exit_code = EXIT_DEFAULT_PROMPT;
+    return 1;
+  }
+
+  char head_name[MAX_BRANCH_BUFFER_SIZE];
+  char head_oid[GIT_OID_HEXSZ + 1];
+  const int resolved = resolveRefNative(git_dir, git_dir, "HEAD", head_name, head_oid);
+  if (resolved < 0) return 0;
+  if (resolved == 0) {
+    // unborn branch, same as when git_repository_head() fails
+    printNonGitPrompt();
+    repo_context->exit_code = EXIT_ABSENT_LOCAL_REF;
+    return 1;
+  }
+
+  repo_context->repo_path = repo_path;
+  snprintf(repo_context->branch_buffer, sizeof(repo_context->branch_buffer), "%s", shortenRefName(head_name));
+  repo_context->repo_name   = strrchr(repo_context->repo_path, '/') + 1;
+  repo_context->branch_name = repo_context->branch_buffer;
+
+  checkForInteractiveRebase(repo_context);
+  printGitPrompt(repo_context);
+
+  repo_context->repo_path = NULL;
+  repo_context->exit_code = EXIT_GIT_PROMPT;
+  return 1;
+}
+
+
+/**
+ * Walks up from the cwd looking for a '.git' directory or gitfile, the
+ * way git_repository_discover() does (without crossing filesystems).
+ *
+ * The result is mapped to a repository path exactly like
+ * findGitRepositoryPath() does, and the git directory of that path is
+ * the one returned - it is the one git_repository_open() would end up
+ * reading. A gitfile (linked worktree, submodule) is followed to the
+ * repository it points into, so the git directory is always a plain
+ * '<repo>/.git' which holds its own refs and packed-refs.
+ *
+ * @param repo_path:  Output buffer (MAX_PATH_BUFFER_SIZE) for the
+ *                    repository path, e.g. "/path/to/projectName".
+ * @param git_dir:    Output buffer (MAX_PATH_BUFFER_SIZE) for the git
+ *                    directory, e.g. "/path/to/projectName/.git".
+ *
+ * @return Returns 1 if a git directory was found, 0 if there is none,
+ *         and -1 if the layout should be handled by libgit2 instead.
+ */
+int findGitDirectoryNative(char *repo_path, char *git_dir) {
+  char path[MAX_PATH_BUFFER_SIZE];
+  char candidate[MAX_PATH_BUFFER_SIZE + 16];
+  char line[MAX_PATH_BUFFER_SIZE];
+  struct stat st;
+
+  if (getcwd(path, sizeof(path)) == NULL || stat(path, &st) != 0) return -1;
+  const dev_t start_device = st.st_dev;
+
+  while (1) {
+    const char *dir = strcmp(path, "/") == 0 ? "" : path;
+    snprintf(candidate, sizeof(candidate), "%s/.git", dir);
+    if (lstat(candidate, &st) == 0) break;
+
+    // a bare repository, or something else libgit2 might accept
+    snprintf(candidate, sizeof(candidate), "%s/HEAD", dir);
+    if (stat(candidate, &st) == 0) return -1;
+
+    if (*dir == '\0') return 0;
+    char *last_slash = strrchr(path, '/');
+    if (last_slash == path) last_slash++;
+    *last_slash = '\0';
+
+    if (stat(path, &st) != 0) return -1;
+    if (st.st_dev != start_device) return 0;
+  }
+
+  // leave safe.directory and friends to libgit2
+  if (st.st_uid != geteuid()) return -1;
+
+  if (S_ISREG(st.st_mode)) {
+    // gitfile, as used by worktrees and submodules
+    if (!readFirstLine(candidate, line, sizeof(line)) || strncmp(line, "gitdir: ", 8) != 0) return -1;
+    const int length = line[8] != '/'
+      ? snprintf(candidate, sizeof(candidate), "%s/%s", path, line + 8)
+      : snprintf(candidate, sizeof(candidate), "%s", line + 8);
+    if (length < 0 || (size_t) length >= sizeof(candidate)) return -1;
+    char *real_path = realpath(candidate, NULL);
+    if (real_path == NULL || strlen(real_path) + 2 > sizeof(candidate)) {
+      free(real_path);
+      return -1;
+    }
+    strcpy(candidate, real_path);
+    free(real_path);
+  }
+  else if (!S_ISDIR(st.st_mode)) {
+    return -1;
+  }
+
+  // "/path/to/projectName/.git/..." becomes "/path/to/projectName"
+  strcat(candidate, "/");
+  char *dot_git = strstr(candidate, "/.git/");
+  if (dot_git == NULL) return -1;
+  *dot_git = '\0';
+  if (strlen(candidate) + 5 >= MAX_PATH_BUFFER_SIZE) return -1;
+  strcpy(repo_path, candidate);
+  sprintf(git_dir, "%s/.git", repo_path);
+
+  if (lstat(git_dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid()) return -1;
+
+  return 1;
+}
+
+
+/**
+ * Resolves a ref by following symbolic refs until a direct ref is
+ * found. Loose refs are tried first, then packed-refs, as git does,
+ * and finally the reftable stack for repositories which use it.
+ * HEAD is read from the git directory, everything under refs/ from
+ * the common directory.
+ *
+ * @param git_dir:       The git directory.
+ * @param common_dir:    The directory holding refs and packed-refs.
+ * @param ref_name:      Full name of the ref to resolve, e.g. "HEAD".
+ * @param resolved_name: Output buffer (MAX_BRANCH_BUFFER_SIZE) for the
+ *                       name of the direct ref, e.g. "refs/heads/main".
+ * @param oid_hex:       Output buffer (GIT_OID_HEXSZ + 1) for the
+ *                       object id the ref points to.
+ *
+ * @return Returns 1 if resolved, 0 if the ref (or a ref it points to)
+ *         doesn't exist, and -1 if something couldn't be parsed.
+ */
+int resolveRefNative(const char *git_dir,
+                     const char *common_dir,
+                     const char *ref_name,
+                     char *resolved_name,
+                     char *oid_hex) {
+  char name[MAX_BRANCH_BUFFER_SIZE];
+  char path[MAX_PATH_BUFFER_SIZE + MAX_BRANCH_BUFFER_SIZE];
+  char line[MAX_REF_LINE_BUFFER_SIZE];
+  snprintf(name, sizeof(name), "%s", ref_name);
+
+  for (int depth = 0; depth < MAX_SYMREF_DEPTH; depth++) {
+    const int in_refs = strncmp(name, "refs/", 5) == 0;
+    const char *ref_dir = in_refs ? common_dir : git_dir;
+    snprintf(path, sizeof(path), "%s/%s", ref_dir, name);
+
+    int found = readFirstLine(path, line, sizeof(line));
+
+    // with reftable, the HEAD file is only there so that older gits
+    // still recognize the repository
+    if (found && !in_refs && strcmp(line, "ref: refs/heads/.invalid") == 0) {
+      found = 0;
+    }
+    if (!found && in_refs) {
+      found = lookupPackedRef(common_dir, name, line);
+    }
+    if (!found) {
+      snprintf(path, sizeof(path), "%s/reftable", ref_dir);
+      found = lookupReftableRef(path, name, line);
+    }
+    if (found <= 0) return found;
+
+    if (strncmp(line, "ref: ", 5) == 0) {
+      if (strlen(line + 5) >= sizeof(name)) return -1;
+      strcpy(name, line + 5);
+      continue;
+    }
+
+    if (strspn(line, "0123456789abcdef") != GIT_OID_HEXSZ || line[GIT_OID_HEXSZ] != '\0') return -1;
+    strcpy(resolved_name, name);
+    strcpy(oid_hex, line);
+    return 1;
+  }
+
+  return -1;
+}
+
+
+/**
+ * Looks up a single ref in the packed-refs file. The file is mmap'd
+ * rather than read, and when git has marked it as sorted (it always
+ * does nowadays) it is binary-searched in place. Only the records the
+ * search lands on are looked at, so the cost barely depends on how
+ * many refs there are.
+ *
+ * @param common_dir: The directory holding packed-refs.
+ * @param ref_name:   Full name of the ref, e.g. "refs/heads/main".
+ * @param oid_hex:    Output buffer (at least GIT_OID_HEXSZ + 1) for
+ *                    the object id of the ref.
+ *
+ * @return Returns 1 if found, 0 if not, and -1 on malformed input.
+ */
+int lookupPackedRef(const char *common_dir, const char *ref_name, char *oid_hex) {
+  char path[MAX_PATH_BUFFER_SIZE + 16];
+  snprintf(path, sizeof(path), "%s/packed-refs", common_dir);
+
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  char *buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buffer == MAP_FAILED) return -1;
+
+  const char *start = buffer;
+  const char *end   = buffer + st.st_size;
+
+  // "# pack-refs with: peeled fully-peeled sorted "
+  int sorted = 0;
+  const char *header = "# pack-refs with:";
+  if ((size_t) st.st_size > strlen(header) && strncmp(start, header, strlen(header)) == 0) {
+    const char *eol = memchr(start, '\n', end - start);
+    if (eol == NULL) {
+      munmap(buffer, st.st_size);
+      return -1;
+    }
+
+    char traits[MAX_REF_LINE_BUFFER_SIZE];
+    snprintf(traits, sizeof(traits), "%.*s ", (int) (eol - start), start);
+    sorted = strstr(traits, " sorted ") != NULL;
+    start = eol + 1;
+  }
+
+  const char *record = NULL;
+  if (sorted) {
+    record = searchPackedRefs(start, end, ref_name);
+  }
+  else {
+    for (const char *line = start; line < end; ) {
+      if (*line != '^' && comparePackedRecord(line, end, ref_name) == 0) {
+        record = line;
+        break;
+      }
+      const char *eol = memchr(line, '\n', end - line);
+      line = eol ? eol + 1 : end;
+    }
+  }
+
+  int found = 0;
+  if (record) {
+    if (end - record > GIT_OID_HEXSZ && strspn(record, "0123456789abcdef") >= GIT_OID_HEXSZ) {
+      memcpy(oid_hex, record, GIT_OID_HEXSZ);
+      oid_hex[GIT_OID_HEXSZ] = '\0';
+      found = 1;
+    }
+    else {
+      found = -1;
+    }
+  }
+
+  munmap(buffer, st.st_size);
+  return found;
+}
+
+
+/**
+ * Binary-searches the records of a sorted packed-refs buffer, the same
+ * way git's packed-refs backend does. A record is a "<oid> <name>"
+ * line, optionally followed by a "^<peeled oid>" line, so positions
+ * are snapped back to the start of a record before comparing.
+ *
+ * @param start:    First byte after the header line.
+ * @param end:      End of the buffer.
+ * @param ref_name: Full name of the ref to find.
+ *
+ * @return Returns a pointer to the matching record, or NULL.
+ */
+const char *searchPackedRefs(const char *start, const char *end, const char *ref_name) {
+  const char *lo = start;
+  const char *hi = end;
+
+  while (lo < hi) {
+    const char *mid = lo + (hi - lo) / 2;
+
+    // back up to the start of the record 'mid' is in
+    const char *record = mid;
+    while (record > lo && (record[-1] != '\n' || record[0] == '^')) record--;
+
+    const int cmp = comparePackedRecord(record, end, ref_name);
+    if (cmp < 0) {
+      // skip past the end of the record (and its peeled line)
+      const char *next = mid;
+      while (++next < hi && (next[-1] != '\n' || next[0] == '^'));
+      lo = next;
+    }
+    else if (cmp > 0) {
+      hi = record;
+    }
+    else {
+      return record;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * Compares the ref name of a packed-refs record with 'ref_name', like
+ * strcmp() does.
+ *
+ * @param record:   Start of a "<oid> <name>\n" record.
+ * @param end:      End of the buffer.
+ * @param ref_name: Full name of the ref to compare with.
+ *
+ * @return Returns <0, 0 or >0 if the record's name sorts before, the
+ *         same as, or after 'ref_name'.
+ */
+int comparePackedRecord(const char *record, const char *end, const char *ref_name) {
+  const char *name = record + GIT_OID_HEXSZ + 1;
+  if (name > end) return 1;
+
+  while (name < end && *name != '\n' && *name != '\r' && *ref_name != '\0') {
+    if (*name != *ref_name) return (unsigned char) *name - (unsigned char) *ref_name;
+    name++;
+    ref_name++;
+  }
+
+  const int name_done = name >= end || *name == '\n' || *name == '\r';
+  if (name_done && *ref_name == '\0') return 0;
+  return name_done ? -1 : 1;
+}
+
+
+/**
+ * Reads the first line of a small file, without its line ending.
+ *
+ * @param path:   File to read.
+ * @param buffer: Output buffer.
+ * @param size:   Size of the output buffer.
+ *
+ * @return Returns 1 if a line was read, otherwise 0.
+ */
+int readFirstLine(const char *path, char *buffer, size_t size) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+
+  const ssize_t length = read(fd, buffer, size - 1);
+  close(fd);
+  if (length <= 0) return 0;
+
+  buffer[length] = '\0';
+  buffer[strcspn(buffer, "\r\n")] = '\0';
+  return 1;
+}
+
+
+/**
+ * Shortens a full ref name the same way git_reference_shorthand()
+ * does, e.g. "refs/heads/main" becomes "main". Names outside refs/
+ * (such as a detached "HEAD") are returned as-is.
+ *
+ * @param ref_name: Full name of the ref.
+ *
+ * @return Returns a pointer into ref_name.
+ */
+const char *shortenRefName(const char *ref_name) {
+  const char *prefixes[] = { "refs/heads/", "refs/tags/", "refs/remotes/", "refs/" };
+  for (unsigned long i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+    const size_t length = strlen(prefixes[i]);
+    if (strncmp(ref_name, prefixes[i], length) == 0)
+      return ref_name + length;
+  }
+  return ref_name;
+}
+
+
+/**
+ * Coordinates prompts which are drawn at the same time in the same
+ * repository (e.g. every tmux pane after a checkout), so that only one
+ * of them scans the working tree. The first one takes an flock on a
+ * per-repo lock file and computes. The others poll the lock for up to
+ * GP_SINGLE_FLIGHT_WAIT_MS and, once they get it, reuse the result the
+ * first one published if it was published after they started waiting,
+ * for the same HEAD, branch and index file, and covers their needs.
+ * Waiters append a byte to the lock file, so that the first one knows
+ * its result is wanted.
+ * A lock held by a process which died is released by the kernel, so
+ * there are no stale locks to clean up.
+ *
+ * @param repo_context: Pointer to the RepoContext structure. HEAD and
+ *                     the branch name must already be resolved. On
+ *                     reuse, the status and divergence fields are
+ *                     filled in.
+ * @param needs:        The prompt_needs which must be computed.
+ * @param flight:       Filled in; pass to finishSingleFlight()
+ *                     afterwards in every case.
+ *
+ * @return: 1 if a concurrent prompt's result was reused, 0 if the
+ *          caller has to compute the status itself.
+ */
+int joinSingleFlight(struct RepoContext *repo_context,
+                     int needs,
+                     struct SingleFlight *flight) {
+  flight->lock_fd = -1;
+  flight->locked  = 0;
+
+  const char *wait_setting = getenv("GP_SINGLE_FLIGHT_WAIT_MS");
+  const long  wait_ms      = wait_setting ? strtol(wait_setting, NULL, 10) : DEFAULT_SINGLE_FLIGHT_WAIT_MS;
+  if (wait_ms <= 0) return 0;
+
+  char lock_path[MAX_PATH_BUFFER_SIZE];
+  if (!getSingleFlightPaths(repo_context, lock_path, flight->result_path)) return 0;
+
+  // a result is only valid for the index it was computed from; taken
+  // before the scan so a concurrent 'git add' is never missed
+  char index_path[MAX_PATH_BUFFER_SIZE];
+  struct stat index_stat;
+  memset(&index_stat, 0, sizeof(index_stat));
+  snprintf(index_path, sizeof(index_path), "%sindex", git_repository_path(repo_context->repo_obj));
+  stat(index_path, &index_stat);
+  flight->index_mtime = GP_STAT_MTIME(index_stat);
+  flight->index_size  = index_stat.st_size;
+
+  flight->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (flight->lock_fd < 0) return 0;
+
+  if (flock(flight->lock_fd, LOCK_EX | LOCK_NB) == 0) {
+    flight->locked = 1;
+    return 0;
+  }
+
+  // someone else is scanning; let it know to publish its result, as
+  // anything published from here on is at least as fresh as what we
+  // would compute ourselves
+  if (write(flight->lock_fd, "w", 1) != 1) return 0;
+
+  struct SharedResult result;
+  const unsigned long seen = readSharedResult(flight->result_path, &result) ? result.generation : 0;
+
+  const struct timespec poll = { 0, SINGLE_FLIGHT_POLL_MS * 1000000L };
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    nanosleep(&poll, NULL);
+    if (flock(flight->lock_fd, LOCK_EX | LOCK_NB) == 0) {
+      flight->locked = 1;
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < wait_ms);
+
+  // timed out: compute without the lock (and without publishing)
+  if (!flight->locked) return 0;
+
+  char head_oid[GIT_OID_HEXSZ + 1];
+  git_oid_tostr(head_oid, sizeof(head_oid), repo_context->head_oid);
+
+  // GP_MAINLINE_REF may differ between shells
+  const char *mainline = getMainlineRef() ?: "-";
+
+  if (!readSharedResult(flight->result_path, &result)               ||
+      result.generation <= seen                                     ||
+      (result.needs & needs) != needs                               ||
+      ((needs & NEEDS_DIVERGENCE_TARGETS) && strcmp(result.mainline, mainline) != 0) ||
+      strcmp(result.head_oid, head_oid) != 0                        ||
+      strcmp(result.branch, repo_context->branch_name) != 0         ||
+      result.index_mtime_sec  != (long long) flight->index_mtime.tv_sec  ||
+      result.index_mtime_nsec != (long) flight->index_mtime.tv_nsec      ||
+      result.index_size       != (long long) flight->index_size) {
+    // keep the lock; our result gets published instead
+    return 0;
+  }
+
+  repo_context->s_repo           = result.s_repo;
+  repo_context->s_index          = result.s_index;
+  repo_context->s_wdir           = result.s_wdir;
+  repo_context->ahead            = result.ahead;
+  repo_context->behind           = result.behind;
+  repo_context->conflict_count   = result.conflict_count;
+  repo_context->staged_changes   = result.staged_changes;
+  repo_context->unstaged_changes = result.unstaged_changes;
+  memcpy(repo_context->targets, result.targets, sizeof(repo_context->targets));
+
+  // nothing new to publish; let the next waiter in
+  flock(flight->lock_fd, LOCK_UN);
+  flight->locked = 0;
+  return 1;
+}
+
+
+/**
+ * Ends a joinSingleFlight(). If this prompt held the lock, computed a
+ * result and another prompt started waiting for it meanwhile, the
+ * result is published: written to a temporary file and renamed into
+ * place, so readers never see a partial result. Without waiters
+ * nothing is written. The lock is then released.
+ *
+ * @param repo_context: Pointer to the RepoContext structure holding
+ *                     the computed result.
+ * @param needs:        The prompt_needs which were computed.
+ * @param flight:       The SingleFlight from joinSingleFlight().
+ */
+void finishSingleFlight(const struct RepoContext *repo_context,
+                        int needs,
+                        struct SingleFlight *flight) {
+  // waiters leave a byte in the lock file; with none there is nobody
+  // to publish for
+  struct stat lock_stat;
+  const int waited = flight->locked &&
+                     fstat(flight->lock_fd, &lock_stat) == 0 &&
+                     lock_stat.st_size > 0;
+
+  // an empty branch name would shift the fields of the result file
+  if (waited && repo_context->exit_code == 0 && repo_context->branch_name[0]) {
+    // the generation only grows while the lock is held
+    struct SharedResult previous;
+    const unsigned long generation =
+      (readSharedResult(flight->result_path, &previous) ? previous.generation : 0) + 1;
+
+    char head_oid[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(head_oid, sizeof(head_oid), repo_context->head_oid);
+
+    char temp_path[MAX_PATH_BUFFER_SIZE + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", flight->result_path, (int) getpid());
+
+    FILE *file = fopen(temp_path, "w");
+    if (file) {
+      fprintf(file, "%lu %d %s %s %lld %ld %lld %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %s\n",
+              generation,
+              needs,
+              head_oid,
+              repo_context->branch_name,
+              (long long) flight->index_mtime.tv_sec,
+              (long) flight->index_mtime.tv_nsec,
+              (long long) flight->index_size,
+              repo_context->s_repo,
+              repo_context->s_index,
+              repo_context->s_wdir,
+              repo_context->ahead,
+              repo_context->behind,
+              repo_context->conflict_count,
+              repo_context->staged_changes,
+              repo_context->unstaged_changes,
+              repo_context->targets[TARGET_UPSTREAM].found,
+              repo_context->targets[TARGET_UPSTREAM].ahead,
+              repo_context->targets[TARGET_UPSTREAM].behind,
+              repo_context->targets[TARGET_PUSH].found,
+              repo_context->targets[TARGET_PUSH].ahead,
+              repo_context->targets[TARGET_PUSH].behind,
+              repo_context->targets[TARGET_MAINLINE].found,
+              repo_context->targets[TARGET_MAINLINE].ahead,
+              repo_context->targets[TARGET_MAINLINE].behind,
+              getMainlineRef() ?: "-");
+      if (fclose(file) != 0 || rename(temp_path, flight->result_path) != 0) {
+        unlink(temp_path);
+      }
+    }
+  }
+
+  // the waiters seen so far are served (or will compute themselves); if
+  // the byte stays, the next holder merely publishes once too often
+  if (waited && ftruncate(flight->lock_fd, 0) != 0) {
+    flight->locked = 0;
+  }
+
+  if (flight->lock_fd >= 0) {
+    // closing also releases the lock
+    close(flight->lock_fd);
+    flight->lock_fd = -1;
+  }
+  flight->locked = 0;
+}
+
+
+/**
+ * Builds the paths of the lock and result files for a repository. They
+ * live in $XDG_RUNTIME_DIR/generate-prompt/, named after a hash of the
+ * git directory, or in the git directory itself when XDG_RUNTIME_DIR
+ * is not set.
+ *
+ * @param repo_context: Pointer to the RepoContext structure with an
+ *                     open repo_obj.
+ * @param lock_path:    Output buffer (MAX_PATH_BUFFER_SIZE).
+ * @param result_path:  Output buffer (MAX_PATH_BUFFER_SIZE).
+ *
+ * @return: 1 on success, 0 if the paths do not fit.
+ */
+int getSingleFlightPaths(const struct RepoContext *repo_context,
+                         char *lock_path,
+                         char *result_path) {
+  const char *git_dir     = git_repository_path(repo_context->repo_obj);
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  char base[MAX_PATH_BUFFER_SIZE];
+  int  length;
+
+  if (runtime_dir && *runtime_dir) {
+    // FNV-1a
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const char *c = git_dir; *c; c++) {
+      hash ^= (unsigned char) *c;
+      hash *= 1099511628211ULL;
+    }
+    length = snprintf(base, sizeof(base), "%s/generate-prompt", runtime_dir);
+    if (length < 0 || (size_t) length >= sizeof(base)) return 0;
+    mkdir(base, 0700);
+    length = snprintf(base, sizeof(base), "%s/generate-prompt/%016llx", runtime_dir, hash);
+  }
+  else {
+    // git_repository_path() ends with a '/'
+    length = snprintf(base, sizeof(base), "%sgenerate-prompt", git_dir);
+  }
+  if (length < 0 || (size_t) length + strlen(".result") >= sizeof(base)) return 0;
+
+  strcpy(lock_path, base);
+  strcat(lock_path, ".lock");
+  strcpy(result_path, base);
+  strcat(result_path, ".result");
+  return 1;
+}
+
+
+/**
+ * Reads a result published by finishSingleFlight().
+ *
+ * @param path:   Path of the result file.
+ * @param result: Filled in on success.
+ *
+ * @return: 1 on success, 0 if there is no (valid) result.
+ */
+int readSharedResult(const char *path, struct SharedResult *result) {
+  FILE *file = fopen(path, "r");
+  if (!file) return 0;
+
+  // field widths match GIT_OID_HEXSZ and MAX_BRANCH_BUFFER_SIZE
+  const int fields = fscanf(file, "%lu %d %40s %255s %lld %ld %lld %d %d %d %d %d %d %d %d "
+                            "%d %d %d %d %d %d %d %d %d %255s",
+                            &result->generation,
+                            &result->needs,
+                            result->head_oid,
+                            result->branch,
+                            &result->index_mtime_sec,
+                            &result->index_mtime_nsec,
+                            &result->index_size,
+                            &result->s_repo,
+                            &result->s_index,
+                            &result->s_wdir,
+                            &result->ahead,
+                            &result->behind,
+                            &result->conflict_count,
+                            &result->staged_changes,
+                            &result->unstaged_changes,
+                            &result->targets[TARGET_UPSTREAM].found,
+                            &result->targets[TARGET_UPSTREAM].ahead,
+                            &result->targets[TARGET_UPSTREAM].behind,
+                            &result->targets[TARGET_PUSH].found,
+                            &result->targets[TARGET_PUSH].ahead,
+                            &result->targets[TARGET_PUSH].behind,
+                            &result->targets[TARGET_MAINLINE].found,
+                            &result->targets[TARGET_MAINLINE].ahead,
+                            &result->targets[TARGET_MAINLINE].behind,
+                            result->mainline);
+  fclose(file);
+  return fields == 25;
+}
+
+
+/**
+ * Implements --explain-cost. Runs the same status pass as a prompt
+ * would, native index parse and working-directory check included, but
+ * instrumented (see CostReport), then prints where the time and I/O
+ * went.
+ *
+ * @param json: 1 to print JSON, 0 for a table.
+ *
+ * @return: EXIT_GIT_PROMPT on success, or the exit code the prompt
+ *          would have had otherwise.
+ */
+int explainCost(int json) {
+  struct CostReport report;
+  memset(&report, 0, sizeof(report));
+  report.last_directory = -1;
+  clock_gettime(CLOCK_MONOTONIC, &report.mark);
+
+  struct RepoContext repo_context;
+  initializeRepoStatus(&repo_context);
+  repo_context.cost_report = &report;
+
+  if (!loadLibgit2()) {
+    return EXIT_FAIL_LIBGIT2;
+  }
+  git_libgit2_init();
+
+  if (!findAndOpenGitRepository(&repo_context)) {
+    fprintf(stderr, "generate-prompt: not in a git repository\n");
+    git_libgit2_shutdown();
+    return repo_context.exit_code;
+  }
+  markCostPhase(&report, COST_OPEN);
+
+  if (!getRepoHeadRef(&repo_context)) {
+    fprintf(stderr, "generate-prompt: HEAD does not point to a commit\n");
+    cleanupResources(&repo_context);
+    return repo_context.exit_code;
+  }
+  extractRepoAndBranchNames(&repo_context);
+  markCostPhase(&report, COST_HEAD);
+
+  setupAndRetrieveGitStatus(&repo_context);
+  checkForConflictsAndDivergence(&repo_context);
+  markCostPhase(&report, COST_DIVERGENCE);
+  report.revwalk_commits = repo_context.revwalk_commits;
+
+  if (repo_context.exit_code == 0) {
+    takeCostCensus(&repo_context, &report);
+    // what checkWorkdirNative() hashed is known; libgit2 doesn't say
+    if (!report.workdir_decided) estimateHashCost(&repo_context, &report);
+    printCostReport(&repo_context, &report, json);
+  }
+  else {
+    fprintf(stderr, "generate-prompt: the status pass failed\n");
+  }
+
+  for (int i = 0; i < report.directory_count; i++)
+    free(report.directories[i].name);
+  free(report.directories);
+
+  const int exit_code = repo_context.exit_code;
+  cleanupResources(&repo_context);
+  return exit_code == 0 ? EXIT_GIT_PROMPT : exit_code;
+}
+
+
+/**
+ * Adds the time since the previous mark to a phase. Does nothing
+ * without a report, so the status pass can call it unconditionally.
+ *
+ * @param report: The CostReport, or NULL.
+ * @param phase:  One of cost_phases.
+ */
+void markCostPhase(struct CostReport *report, int phase) {
+  if (!report) return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  report->phase_ms[phase] += elapsedMilliseconds(&report->mark, &now);
+  report->mark = now;
+}
+
+
+/**
+ * Diff progress callback for the index->workdir pass of
+ * --explain-cost. libgit2 calls it before it looks at each path, so the
+ * time until the next call is charged to the top-level directory of
+ * this one. Call it with NULL paths once the diff is done to charge the
+ * time after the last path. In a census pass nothing is timed; every
+ * path which exists in the working directory is counted as stat'ed
+ * instead.
+ *
+ * @param diff:     The diff being built (unused).
+ * @param old_path: The path in the index, or NULL.
+ * @param new_path: The path in the working directory, or NULL.
+ * @param payload:  The StatusPass for the diff.
+ *
+ * @return: 0 to continue the diff.
+ */
+int recordWorkdirProgress(const git_diff *diff,
+                          const char *old_path,
+                          const char *new_path,
+                          void *payload) {
+  (void) diff;
+  const struct StatusPass *pass = payload;
+  struct CostReport *report = pass->cost_report;
+  if (!report) return 0;
+
+  if (pass->census) {
+    if (new_path) findDirectoryCost(report, new_path)->stat_count++;
+    return 0;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (report->last_directory >= 0) {
+    report->directories[report->last_directory].milliseconds +=
+      elapsedMilliseconds(&report->last_progress, &now);
+  }
+  report->last_progress  = now;
+  report->last_directory = -1;
+
+  const char *path = new_path ?: old_path;
+  if (path) report->last_directory = findDirectoryCost(report, path) - report->directories;
+  return 0;
+}
+
+
+/**
+ * Returns the DirectoryCost for the top-level directory of a path
+ * ("." for files in the root), adding it if needed. Paths arrive
+ * sorted, so the last directory looked up is checked first.
+ *
+ * @param report: The CostReport.
+ * @param path:   A path relative to the working directory.
+ *
+ * @return: The DirectoryCost. Exits if memory runs out.
+ */
+struct DirectoryCost *findDirectoryCost(struct CostReport *report, const char *path) {
+  const char  *slash  = strchr(path, '/');
+  const size_t length = slash ? (size_t) (slash - path) : 1;
+  const char  *name   = slash ? path : ".";
+
+  if (report->last_directory >= 0) {
+    struct DirectoryCost *last = &report->directories[report->last_directory];
+    if (strncmp(last->name, name, length) == 0 && last->name[length] == '\0') return last;
+  }
+  for (int i = 0; i < report->directory_count; i++) {
+    struct DirectoryCost *directory = &report->directories[i];
+    if (strncmp(directory->name, name, length) == 0 && directory->name[length] == '\0') return directory;
+  }
+
+  struct DirectoryCost *directories =
+    realloc(report->directories, (report->directory_count + 1) * sizeof(*directories));
+  char *copy = strndup(name, length);
+  if (!directories || !copy) {
+    fprintf(stderr, "generate-prompt: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  report->directories = directories;
+
+  struct DirectoryCost *directory = &directories[report->directory_count++];
+  memset(directory, 0, sizeof(*directory));
+  directory->name = copy;
+  return directory;
+}
+
+
+/**
+ * The untimed part of --explain-cost. The timed passes are the
+ * prompt's own: they stop at the first change and never report
+ * untracked files. This runs libgit2's diffs once more without
+ * stopping, to count what a full scan covers: the staged adds and
+ * deletes 'git status' would pair up as rename candidates, and per
+ * top-level directory the files stat'ed, the untracked or ignored
+ * entries checked against the ignore rules and the submodules.
+ *
+ * @param repo_context: Pointer to the RepoContext structure with an
+ *                     open repo_obj and a resolved HEAD.
+ * @param report:       The CostReport to add to.
+ */
+void takeCostCensus(struct RepoContext *repo_context, struct CostReport *report) {
+  git_index *index = NULL;
+  if (git_repository_index(&index, repo_context->repo_obj) != 0) return;
+
+  // each submodule is opened and checked on its own; the native check
+  // leaves them to libgit2
+  const size_t entry_count = git_index_entrycount(index);
+  for (size_t i = 0; i < entry_count; i++) {
+    const git_index_entry *entry = git_index_get_byindex(index, i);
+    if (entry->mode == GIT_FILEMODE_COMMIT && git_index_entry_stage(entry) == 0 &&
+        !(entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE))
+      findDirectoryCost(report, entry->path)->submodules++;
+  }
+
+  git_tree   *head_tree   = NULL;
+  git_commit *head_commit = NULL;
+  if (git_commit_lookup(&head_commit, repo_context->repo_obj, repo_context->head_oid) == 0) {
+    git_commit_tree(&head_tree, head_commit);
+    git_commit_free(head_commit);
+  }
+
+  // see setupAndRetrieveGitStatus()
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+  git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+  #pragma GCC diagnostic pop
+  opts.flags     = GIT_DIFF_INCLUDE_TYPECHANGE;
+  opts.notify_cb = countStatusDelta;
+
+  struct StatusPass staged   = {1, 0, report, 1};
+  struct StatusPass unstaged = {0, 0, report, 1};
+  git_diff *diff = NULL;
+
+  opts.payload = &staged;
+  git_diff_tree_to_index(&diff, repo_context->repo_obj, head_tree, index, &opts);
+  git_diff_free(diff);
+  diff = NULL;
+
+  opts.flags      |= GIT_DIFF_INCLUDE_UNTRACKED | GIT_DIFF_INCLUDE_IGNORED;
+  opts.payload     = &unstaged;
+  opts.progress_cb = recordWorkdirProgress;
+  git_diff_index_to_workdir(&diff, repo_context->repo_obj, index, &opts);
+  git_diff_free(diff);
+
+  git_tree_free(head_tree);
+  git_index_free(index);
+}
+
+
+/**
+ * Estimates which index entries libgit2's index->workdir pass had to
+ * hash, using the same checks libgit2 makes before it re-reads a file:
+ * the size matches but other stat data does not (stat-changed), or the
+ * file is as new as the index itself (racy). Not needed when
+ * checkWorkdirNative() decided the working-directory state; it counts
+ * what it hashed.
+ *
+ * @param repo_context: Pointer to the RepoContext structure with an
+ *                     open repo_obj.
+ * @param report:       The CostReport to add to.
+ */
+void estimateHashCost(struct RepoContext *repo_context, struct CostReport *report) {
+  git_index *index = NULL;
+  const char *workdir = git_repository_workdir(repo_context->repo_obj);
+  if (!workdir || git_repository_index(&index, repo_context->repo_obj) != 0) return;
+
+  struct stat index_stat;
+  if (stat(git_index_path(index), &index_stat) != 0) {
+    git_index_free(index);
+    return;
+  }
+
+  char path[MAX_PATH_BUFFER_SIZE];
+  report->last_directory = -1;
+  const size_t entry_count = git_index_entrycount(index);
+  for (size_t i = 0; i < entry_count; i++) {
+    const git_index_entry *entry = git_index_get_byindex(index, i);
+    if (git_index_entry_stage(entry) != 0) continue;
+    if (entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE) continue;
+    if (entry->mode == GIT_FILEMODE_COMMIT) continue;
+
+    struct stat file_stat;
+    const int length = snprintf(path, sizeof(path), "%s%s", workdir, entry->path);
+    if (length < 0 || (size_t) length >= sizeof(path) || lstat(path, &file_stat) != 0) continue;
+
+    // a different file type or mode is a change libgit2 needs no hash for
+    const uint32_t mode = S_ISLNK(file_stat.st_mode)      ? GIT_FILEMODE_LINK :
+                          !S_ISREG(file_stat.st_mode)     ? 0 :
+                          (file_stat.st_mode & S_IXUSR)   ? GIT_FILEMODE_BLOB_EXECUTABLE :
+                                                            GIT_FILEMODE_BLOB;
+    if (mode != entry->mode) continue;
+
+    int stat_changed = 0;
+    int racy         = 0;
+    if ((uint32_t) file_stat.st_size != entry->file_size) {
+      // so is a different size, unless the index has none recorded
+      if (entry->file_size != 0) continue;
+      stat_changed = 1;
+    }
+    else if (entry->mtime.seconds     != (int32_t)  GP_STAT_MTIME(file_stat).tv_sec  ||
+             entry->mtime.nanoseconds != (uint32_t) GP_STAT_MTIME(file_stat).tv_nsec ||
+             entry->ctime.seconds     != (int32_t)  GP_STAT_CTIME(file_stat).tv_sec  ||
+             entry->ctime.nanoseconds != (uint32_t) GP_STAT_CTIME(file_stat).tv_nsec ||
+             entry->ino               != (uint32_t) file_stat.st_ino                 ||
+             entry->uid               != (uint32_t) file_stat.st_uid                 ||
+             entry->gid               != (uint32_t) file_stat.st_gid) {
+      stat_changed = 1;
+    }
+    else if (GP_STAT_MTIME(file_stat).tv_sec > GP_STAT_MTIME(index_stat).tv_sec ||
+             (GP_STAT_MTIME(file_stat).tv_sec == GP_STAT_MTIME(index_stat).tv_sec &&
+              GP_STAT_MTIME(file_stat).tv_nsec >= GP_STAT_MTIME(index_stat).tv_nsec)) {
+      racy = 1;
+    }
+    if (!stat_changed && !racy) continue;
+
+    struct DirectoryCost *directory = findDirectoryCost(report, entry->path);
+    directory->hashed_files++;
+    directory->hashed_bytes += file_stat.st_size;
+    report->last_directory = directory - report->directories;
+    if (racy) report->racy_entries++;
+    else      report->stat_changed_entries++;
+  }
+
+  git_index_free(index);
+}
+
+
+/**
+ * Turns a CostReport into suggestions for what to fix, in the order
+ * they usually matter.
+ *
+ * @param report: The CostReport, with directories ranked.
+ * @param hints:  Output, up to MAX_HINTS lines.
+ *
+ * @return: The number of hints.
+ */
+int collectCostHints(const struct CostReport *report,
+                     char hints[][MAX_HINT_BUFFER_SIZE]) {
+  int count = 0;
+  long hashed_files = 0, submodules = 0;
+  long long hashed_bytes = 0;
+  for (int i = 0; i < report->directory_count; i++) {
+    hashed_files  += report->directories[i].hashed_files;
+    hashed_bytes  += report->directories[i].hashed_bytes;
+    submodules    += report->directories[i].submodules;
+  }
+
+  // one directory dominating the scan
+  if (report->directory_count > 0) {
+    const struct DirectoryCost *top = &report->directories[0];
+    if (strcmp(top->name, ".") != 0 &&
+        top->stat_count >= EXPLAIN_HINT_STAT_FILES &&
+        top->milliseconds * 2 >= report->phase_ms[COST_WORKDIR]) {
+      snprintf(hints[count++], MAX_HINT_BUFFER_SIZE,
+               "'%s' takes most of the working-directory scan (%ld files); if you don't "
+               "work in it, leave it out with 'git sparse-checkout'", top->name, top->stat_count);
+    }
+  }
+
+  if (hashed_files > 0) {
+    char bytes[32];
+    snprintf(hints[count++], MAX_HINT_BUFFER_SIZE,
+             "%ld files (%s) are re-hashed on every prompt because their stat data in the "
+             "index is stale or racy; refresh it with 'git update-index --refresh'",
+             hashed_files, formatByteCount(hashed_bytes, bytes, sizeof(bytes)));
+  }
+
+  for (int i = 0; i < report->directory_count && count < MAX_HINTS - 3; i++) {
+    const struct DirectoryCost *directory = &report->directories[i];
+    if (directory->ignore_checks >= EXPLAIN_HINT_IGNORE_CHECKS) {
+      snprintf(hints[count++], MAX_HINT_BUFFER_SIZE,
+               "'%s' has %ld untracked or ignored entries, each checked against the ignore "
+               "rules; move generated files out of the work tree", directory->name,
+               directory->ignore_checks);
+    }
+  }
+
+  if (submodules > 0) {
+    snprintf(hints[count++], MAX_HINT_BUFFER_SIZE,
+             "%ld submodules are opened and scanned; set 'submodule.<name>.ignore' to "
+             "'dirty' or 'all' for the ones you don't need in the prompt", submodules);
+  }
+
+  const long long rename_pairs = (long long) report->staged_adds * report->staged_deletes;
+  if (rename_pairs >= EXPLAIN_HINT_RENAME_PAIRS) {
+    snprintf(hints[count++], MAX_HINT_BUFFER_SIZE,
+             "%lld rename candidate pairs are staged; the prompt skips rename detection, but "
+             "'git status' will not; commit or set 'status.renames=false'", rename_pairs);
+  }
+
+  if (report->revwalk_commits >= EXPLAIN_HINT_REVWALK_COMMITS) {
+    snprintf(hints[count++], MAX_HINT_BUFFER_SIZE,
+             "the branch is %d commits away from its upstream; rebase, or drop \\pa, \\pb "
+             "and \\pd from the prompt", report->revwalk_commits);
+  }
+
+  return count;
+}
+
+
+/**
+ * Prints a CostReport, either as a ranked table or as JSON.
+ *
+ * @param repo_context: Pointer to the RepoContext structure after the
+ *                     status pass.
+ * @param report:       The CostReport. Its directories are sorted.
+ * @param json:         1 to print JSON, 0 for a table.
+ */
+void printCostReport(const struct RepoContext *repo_context,
+                     struct CostReport *report,
+                     int json) {
+  static const char *phase_names[COST_PHASE_COUNT] = {
+    [ COST_OPEN       ] = "open",
+    [ COST_HEAD       ] = "head",
+    [ COST_PARSE      ] = "parse",
+    [ COST_INDEX      ] = "index",
+    [ COST_STAGED     ] = "staged",
+    [ COST_WORKDIR    ] = "workdir",
+    [ COST_HASH       ] = "hash",
+    [ COST_DIVERGENCE ] = "divergence",
+  };
+  static const char *phase_descriptions[COST_PHASE_COUNT] = {
+    [ COST_OPEN       ] = "open repository",
+    [ COST_HEAD       ] = "resolve HEAD",
+    [ COST_PARSE      ] = "parse index",
+    [ COST_INDEX      ] = "load index (libgit2)",
+    [ COST_STAGED     ] = "HEAD -> index",
+    [ COST_WORKDIR    ] = "index -> working directory",
+    [ COST_HASH       ] = "hash files",
+    [ COST_DIVERGENCE ] = "divergence (revwalk)",
+  };
+
+  qsort(report->directories, report->directory_count, sizeof(*report->directories), compareDirectoryCost);
+
+  double total_ms = 0;
+  for (int i = 0; i < COST_PHASE_COUNT; i++) total_ms += report->phase_ms[i];
+
+  struct DirectoryCost totals;
+  memset(&totals, 0, sizeof(totals));
+  for (int i = 0; i < report->directory_count; i++) {
+    totals.stat_count    += report->directories[i].stat_count;
+    totals.hashed_files  += report->directories[i].hashed_files;
+    totals.hashed_bytes  += report->directories[i].hashed_bytes;
+    totals.ignore_checks += report->directories[i].ignore_checks;
+    totals.submodules    += report->directories[i].submodules;
+  }
+  const long long rename_pairs = (long long) report->staged_adds * report->staged_deletes;
+
+  char hints[MAX_HINTS][MAX_HINT_BUFFER_SIZE];
+  const int hint_count = collectCostHints(report, hints);
+
+  if (json) {
+    printf("{\n  \"repository\": ");
+    printJsonString(repo_context->repo_name);
+    printf(",\n  \"branch\": ");
+    printJsonString(repo_context->branch_name);
+    printf(",\n  \"phases_ms\": {");
+    for (int i = 0; i < COST_PHASE_COUNT; i++)
+      printf("\"%s\": %.3f, ", phase_names[i], report->phase_ms[i]);
+    printf("\"total\": %.3f},\n", total_ms);
+
+    printf("  \"directories\": [");
+    for (int i = 0; i < report->directory_count; i++) {
+      const struct DirectoryCost *directory = &report->directories[i];
+      printf("%s\n    {\"name\": ", i ? "," : "");
+      printJsonString(directory->name);
+      printf(", \"ms\": %.3f, \"stat\": %ld, \"hashed_files\": %ld, \"hashed_bytes\": %lld, "
+             "\"ignore_checks\": %ld, \"submodules\": %ld}",
+             directory->milliseconds, directory->stat_count, directory->hashed_files,
+             directory->hashed_bytes, directory->ignore_checks, directory->submodules);
+    }
+    printf("%s],\n", report->directory_count ? "\n  " : "");
+
+    printf("  \"totals\": {\"stat\": %ld, \"hashed_files\": %ld, \"hashed_bytes\": %lld, "
+           "\"racy_entries\": %ld, \"stat_changed_entries\": %ld, \"rename_candidate_pairs\": %lld, "
+           "\"submodules\": %ld, \"ignore_checks\": %ld, \"revwalk_commits\": %d, \"index_blocks\": %zu},\n",
+           totals.stat_count, totals.hashed_files, totals.hashed_bytes,
+           report->racy_entries, report->stat_changed_entries, rename_pairs,
+           totals.submodules, totals.ignore_checks, report->revwalk_commits, report->index_blocks);
+
+    printf("  \"hints\": [");
+    for (int i = 0; i < hint_count; i++) {
+      printf("%s\n    ", i ? "," : "");
+      printJsonString(hints[i]);
+    }
+    printf("%s]\n}\n", hint_count ? "\n  " : "");
+    return;
+  }
+
+  char bytes[32];
+  printf("STATUS COST FOR %s (%s)\n\n", repo_context->repo_name, repo_context->branch_name);
+
+  printf("  %-28s %10s\n", "PHASE", "TIME(ms)");
+  for (int i = 0; i < COST_PHASE_COUNT; i++)
+    printf("  %-28s %10.2f\n", phase_descriptions[i], report->phase_ms[i]);
+  printf("  %-28s %10.2f\n\n", "total", total_ms);
+
+  printf("  %-24s %10s %8s %8s %12s %8s %6s\n",
+         "DIRECTORY", "TIME(ms)", "STAT'ED", "HASHED", "HASHED BYTES", "IGNORE", "SUBMOD");
+  for (int i = 0; i < report->directory_count && i < EXPLAIN_TABLE_ROWS; i++) {
+    const struct DirectoryCost *directory = &report->directories[i];
+    printf("  %-24s %10.2f %8ld %8ld %12s %8ld %6ld\n",
+           directory->name, directory->milliseconds, directory->stat_count,
+           directory->hashed_files, formatByteCount(directory->hashed_bytes, bytes, sizeof(bytes)),
+           directory->ignore_checks, directory->submodules);
+  }
+  if (report->directory_count > EXPLAIN_TABLE_ROWS)
+    printf("  (%d more, see --explain-cost=json)\n", report->directory_count - EXPLAIN_TABLE_ROWS);
+  printf("\n");
+
+  printf("  %-28s %10ld\n",   "files stat'ed",          totals.stat_count);
+  printf("  %-28s %10s (%ld stat-changed, %ld racy)\n",
+         report->workdir_decided ? "bytes hashed" : "bytes hashed (estimated)",
+         formatByteCount(totals.hashed_bytes, bytes, sizeof(bytes)),
+         report->stat_changed_entries, report->racy_entries);
+  printf("  %-28s %10lld\n",  "rename candidate pairs", rename_pairs);
+  printf("  %-28s %10ld\n",   "submodules visited",     totals.submodules);
+  printf("  %-28s %10ld\n",   "ignore-rule evaluations", totals.ignore_checks);
+  printf("  %-28s %10d\n",    "revwalk commits",        report->revwalk_commits);
+  printf("  %-28s %10zu\n\n", "index blocks parsed",    report->index_blocks);
+
+  printf("HINTS\n");
+  if (hint_count == 0) printf("  nothing stands out\n");
+  for (int i = 0; i < hint_count; i++) printf("  - %s\n", hints[i]);
+}
+
+
+/**
+ * qsort comparator for DirectoryCosts: most time first, then most
+ * files stat'ed, then by name.
+ *
+ * @param a: The first DirectoryCost.
+ * @param b: The second DirectoryCost.
+ *
+ * @return: <0, 0 or >0 as for strcmp().
+ */
+int compareDirectoryCost(const void *a, const void *b) {
+  const struct DirectoryCost *left  = a;
+  const struct DirectoryCost *right = b;
+
+  if (left->milliseconds != right->milliseconds)
+    return left->milliseconds < right->milliseconds ? 1 : -1;
+  if (left->stat_count != right->stat_count)
+    return left->stat_count < right->stat_count ? 1 : -1;
+  return strcmp(left->name, right->name);
+}
+
+
+/**
+ * Prints a string as a JSON string literal, quotes included.
+ *
+ * @param text: The string to print.
+ */
+void printJsonString(const char *text) {
+  putchar('"');
+  for (const unsigned char *c = (const unsigned char *) text; *c; c++) {
+    if      (*c == '"' || *c == '\\') printf("\\%c", *c);
+    else if (*c == '\n')              printf("\\n");
+    else if (*c < 0x20)               printf("\\u%04x", *c);
+    else                              putchar(*c);
+  }
+  putchar('"');
+}
+
+
+/**
+ * Formats a byte count for humans, e.g. "512 B" or "4.2 MiB".
+ *
+ * @param bytes:  The byte count.
+ * @param buffer: Output buffer.
+ * @param size:   Size of 'buffer'.
+ *
+ * @return: 'buffer'.
+ */
+const char *formatByteCount(long long bytes, char *buffer, size_t size) {
+  static const char *units[] = { "KiB", "MiB", "GiB", "TiB" };
+
+  if (bytes < 1024) {
+    snprintf(buffer, size, "%lld B", bytes);
+    return buffer;
+  }
+  double value = bytes / 1024.0;
+  size_t unit  = 0;
+  while (value >= 1024 && unit + 1 < sizeof(units) / sizeof(*units)) {
+    value /= 1024;
+    unit++;
+  }
+  snprintf(buffer, size, "%.1f %s", value, units[unit]);
+  return buffer;
+}
+
+
+/**
+ * Milliseconds between two CLOCK_MONOTONIC timestamps.
+ *
+ * @param since: The earlier timestamp.
+ * @param until: The later timestamp.
+ *
+ * @return: The difference in milliseconds.
+ */
+double elapsedMilliseconds(const struct timespec *since, const struct timespec *until) {
+  return (until->tv_sec - since->tv_sec) * 1e3 + (until->tv_nsec - since->tv_nsec) / 1e6;
 }
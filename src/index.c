@@ -0,0 +1,579 @@
+/* --------------------------------------------------
+ * Includes
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "index.h"
+#include "reftable.h"
+#include "sha1.h"
+#include "tasks.h"
+
+
+/* --------------------------------------------------
+ * Functions
+ */
+
+/**
+ * Maps .git/index and parses it without libgit2 (which reads the whole
+ * file into memory, checksums it and copies every entry). The entries
+ * are parsed straight from the mapping into git_index_entry structs;
+ * with index v2/v3 their paths point into the mapping, with v4 the
+ * prefix-compressed paths are rebuilt.
+ *
+ * If git wrote the EOIE and IEOT extensions (index.threads), the
+ * entries come in blocks which can be parsed independently, and are
+ * parsed on up to MAX_INDEX_THREADS threads. Otherwise they are parsed
+ * in one go.
+ *
+ * Anything out of the ordinary (split or sparse indexes, unknown
+ * required extensions, malformed data) is left to libgit2. The checksum
+ * is not verified; git and libgit2 replace the index by renaming, so a
+ * torn file is not something a reader can see.
+ *
+ * @param path:  Path of the index file.
+ * @param index: Receives the parsed index. Free with freeNativeIndex()
+ *               if 1 is returned.
+ *
+ * @return: 1 on success, 0 if the index has to be read by libgit2.
+ */
+int loadNativeIndex(const char *path, struct NativeIndex *index) {
+  memset(index, 0, sizeof(*index));
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  if (fstat(fd, &index->file_stat) != 0 ||
+      index->file_stat.st_size < INDEX_HEADER_SIZE + GIT_OID_RAWSZ) {
+    close(fd);
+    return 0;
+  }
+  index->size = index->file_stat.st_size;
+  void *map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+  index->map = map;
+
+  // header: 'DIRC', version, number of entries
+  index->version     = readBigEndian32(index->map + 4);
+  index->entry_count = readBigEndian32(index->map + 8);
+  if (memcmp(index->map, "DIRC", 4) != 0 || index->version < 2 || index->version > 4 ||
+      index->entry_count > (index->size - INDEX_HEADER_SIZE) / INDEX_ENTRY_FIXED_SIZE) {
+    goto fail;
+  }
+  index->entries = calloc(index->entry_count ? index->entry_count : 1, sizeof(git_index_entry));
+  if (!index->entries) goto fail;
+
+  // EOIE, the last extension, says where the extensions start
+  size_t extensions = 0;
+  if (index->size >= INDEX_HEADER_SIZE + INDEX_EOIE_SIZE + GIT_OID_RAWSZ) {
+    const unsigned char *eoie = index->map + index->size - GIT_OID_RAWSZ - INDEX_EOIE_SIZE;
+    if (memcmp(eoie, "EOIE", 4) == 0 &&
+        readBigEndian32(eoie + 4) == INDEX_EOIE_SIZE - INDEX_EXTENSION_HEADER_SIZE) {
+      extensions = readBigEndian32(eoie + INDEX_EXTENSION_HEADER_SIZE);
+      if (extensions < INDEX_HEADER_SIZE || extensions > index->size - GIT_OID_RAWSZ - INDEX_EOIE_SIZE)
+        goto fail;
+    }
+  }
+
+  if (!extensions || !readIndexOffsetTable(index, extensions)) {
+    index->blocks = calloc(1, sizeof(struct IndexBlock));
+    if (!index->blocks) goto fail;
+    index->block_count          = 1;
+    index->blocks[0].offset      = INDEX_HEADER_SIZE;
+    index->blocks[0].entry_count = index->entry_count;
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t thread_count = cpus > 0 ? (size_t) cpus : 1;
+  if (thread_count > MAX_INDEX_THREADS)   thread_count = MAX_INDEX_THREADS;
+  if (thread_count > index->block_count) thread_count = index->block_count;
+
+  struct Task tasks[MAX_INDEX_THREADS];
+  for (size_t i = 0; i < thread_count; i++) {
+    tasks[i].run      = runIndexParseTask;
+    tasks[i].argument = index;
+  }
+  runTasks(tasks, thread_count);
+
+  // blocks have to follow each other exactly
+  for (size_t i = 0; i < index->block_count; i++) {
+    const struct IndexBlock *block = &index->blocks[i];
+    const size_t next = i + 1 < index->block_count ? index->blocks[i + 1].offset : extensions;
+    if (block->failed || (next && block->end != next)) goto fail;
+    index->intent_to_add    |= block->intent_to_add;
+    index->conflict_entries += block->conflict_entries;
+  }
+
+  const size_t entries_end = index->blocks[index->block_count - 1].end;
+  if (!readIndexExtensions(index, extensions ? extensions : entries_end)) goto fail;
+  return 1;
+
+fail:
+  freeNativeIndex(index);
+  return 0;
+}
+
+
+/**
+ * Releases a NativeIndex.
+ *
+ * @param index: The index. May have been only partly loaded.
+ */
+void freeNativeIndex(struct NativeIndex *index) {
+  for (size_t i = 0; i < index->block_count; i++) free(index->blocks[i].paths);
+  free(index->blocks);
+  free(index->entries);
+  if (index->map) munmap(index->map, index->size);
+  memset(index, 0, sizeof(*index));
+}
+
+
+/**
+ * Splits a NativeIndex into the blocks listed by its IEOT (index entry
+ * offset table) extension, if it has one. git makes the first path of
+ * every block share no prefix with the one before, so with index v4
+ * blocks can be parsed independently too.
+ *
+ * @param index:      The index; its blocks are set up.
+ * @param extensions: Offset of the first extension, from EOIE.
+ *
+ * @return: 1 if there is a usable offset table, 0 if not.
+ */
+int readIndexOffsetTable(struct NativeIndex *index, size_t extensions) {
+  const size_t end = index->size - GIT_OID_RAWSZ;
+
+  size_t offset = extensions;
+  while (offset + INDEX_EXTENSION_HEADER_SIZE <= end) {
+    const unsigned char *extension = index->map + offset;
+    const size_t size = readBigEndian32(extension + 4);
+    if (size > end - offset - INDEX_EXTENSION_HEADER_SIZE) return 0;
+    offset += INDEX_EXTENSION_HEADER_SIZE + size;
+    if (memcmp(extension, "IEOT", 4) != 0) continue;
+
+    // version, then an (offset, entry count) pair per block
+    const unsigned char *table = extension + INDEX_EXTENSION_HEADER_SIZE;
+    if (size < 4 || readBigEndian32(table) != 1 || (size - 4) % 8 != 0) return 0;
+    const size_t block_count = (size - 4) / 8;
+    if (block_count == 0) return 0;
+
+    struct IndexBlock *blocks = calloc(block_count, sizeof(*blocks));
+    if (!blocks) return 0;
+    size_t first_entry = 0;
+    int    ordered     = 1;
+    for (size_t i = 0; i < block_count; i++) {
+      blocks[i].offset      = readBigEndian32(table + 4 + 8 * i);
+      blocks[i].entry_count = readBigEndian32(table + 8 + 8 * i);
+      blocks[i].first_entry = first_entry;
+      first_entry += blocks[i].entry_count;
+      if (blocks[i].offset > extensions || (i > 0 && blocks[i].offset <= blocks[i - 1].offset))
+        ordered = 0;
+    }
+    if (!ordered || first_entry != index->entry_count || blocks[0].offset != INDEX_HEADER_SIZE) {
+      free(blocks);
+      return 0;
+    }
+
+    index->blocks      = blocks;
+    index->block_count = block_count;
+    return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Task for loadNativeIndex(): parses blocks until none are left.
+ *
+ * @param argument: The NativeIndex.
+ */
+void runIndexParseTask(void *argument) {
+  struct NativeIndex *index = argument;
+  for (;;) {
+    const size_t i = __atomic_fetch_add(&index->next_block, 1, __ATOMIC_RELAXED);
+    if (i >= index->block_count) break;
+
+    struct IndexBlock *block = &index->blocks[i];
+    block->failed = !parseIndexBlock(index, block);
+  }
+}
+
+
+/**
+ * Parses the entries of one IndexBlock into the NativeIndex's entry
+ * array. Entries are the stat data, object id and flags, followed by
+ * the path: NUL-padded to a multiple of 8 bytes with v2/v3, and with
+ * v4 a varint (how many bytes to drop from the end of the previous
+ * path) and the NUL-terminated part which replaces them.
+ *
+ * @param index: The index.
+ * @param block: The block; its end (and, for v4, paths) are set.
+ *
+ * @return: 1 on success, 0 on malformed or unsupported entries.
+ */
+int parseIndexBlock(struct NativeIndex *index, struct IndexBlock *block) {
+  const unsigned char *cursor = index->map + block->offset;
+  const unsigned char *end    = index->map + index->size - GIT_OID_RAWSZ;
+  git_index_entry *entries    = index->entries + block->first_entry;
+
+  // v4: paths are rebuilt one after the other; entries hold offsets
+  // into 'paths' until it stops moving
+  size_t *path_offsets  = NULL;
+  size_t  paths_size    = 0;
+  size_t  paths_used    = 0;
+  size_t  previous      = 0;
+  size_t  previous_size = 0;
+  if (index->version == 4) {
+    path_offsets = malloc((block->entry_count ? block->entry_count : 1) * sizeof(*path_offsets));
+    if (!path_offsets) return 0;
+  }
+
+  int ok = 0;
+  for (size_t i = 0; i < block->entry_count; i++) {
+    const unsigned char *start = cursor;
+    if (end - cursor < INDEX_ENTRY_FIXED_SIZE) goto done;
+
+    git_index_entry *entry   = &entries[i];
+    entry->ctime.seconds     = readBigEndian32(cursor);
+    entry->ctime.nanoseconds = readBigEndian32(cursor + 4);
+    entry->mtime.seconds     = readBigEndian32(cursor + 8);
+    entry->mtime.nanoseconds = readBigEndian32(cursor + 12);
+    entry->dev               = readBigEndian32(cursor + 16);
+    entry->ino               = readBigEndian32(cursor + 20);
+    entry->mode              = readBigEndian32(cursor + 24);
+    entry->uid               = readBigEndian32(cursor + 28);
+    entry->gid               = readBigEndian32(cursor + 32);
+    entry->file_size         = readBigEndian32(cursor + 36);
+    memcpy(entry->id.id, cursor + 40, GIT_OID_RAWSZ);
+    entry->flags = (cursor[60] << 8) | cursor[61];
+    cursor += INDEX_ENTRY_FIXED_SIZE;
+
+    if (entry->flags & GIT_INDEX_ENTRY_EXTENDED) {
+      if (index->version < 3 || end - cursor < 2) goto done;
+      entry->flags_extended = (cursor[0] << 8) | cursor[1];
+      cursor += 2;
+      if (entry->flags_extended & GIT_INDEX_ENTRY_INTENT_TO_ADD) block->intent_to_add = 1;
+    }
+
+    // sparse indexes have directory entries, which nothing here expects
+    if (entry->mode == GIT_FILEMODE_TREE) goto done;
+    if (GIT_INDEX_ENTRY_STAGE(entry) != 0) block->conflict_entries++;
+
+    if (index->version < 4) {
+      // names of 0xfff bytes or more are only NUL-terminated
+      size_t length = entry->flags & INDEX_NAME_MASK;
+      if (length == INDEX_NAME_MASK) {
+        const unsigned char *nul = memchr(cursor, '\0', end - cursor);
+        if (!nul) goto done;
+        length = nul - cursor;
+      }
+      const size_t entry_size = (cursor - start + length + 8) & ~(size_t) 7;
+      if (entry_size > (size_t) (end - start) || cursor[length] != '\0') goto done;
+      entry->path = (const char *) cursor;
+      cursor = start + entry_size;
+      continue;
+    }
+
+    // index v4 uses the same varints as reftable. A block's first
+    // entry is stripped relative to the previous block's last one,
+    // which readers of the block ignore.
+    uint64_t strip = 0;
+    cursor = readReftableVarint(cursor, end, &strip);
+    if (!cursor || (i > 0 && strip > previous_size)) goto done;
+    const unsigned char *nul = memchr(cursor, '\0', end - cursor);
+    if (!nul) goto done;
+
+    const size_t kept   = i > 0 ? previous_size - strip : 0;
+    const size_t length = kept + (nul - cursor);
+    if (paths_used + length + 1 > paths_size) {
+      size_t grown_size = paths_size ? paths_size * 2 : 4096;
+      while (grown_size < paths_used + length + 1) grown_size *= 2;
+      char *grown = realloc(block->paths, grown_size);
+      if (!grown) goto done;
+      block->paths = grown;
+      paths_size   = grown_size;
+    }
+    memcpy(block->paths + paths_used, block->paths + previous, kept);
+    memcpy(block->paths + paths_used + kept, cursor, nul - cursor + 1);
+    path_offsets[i] = paths_used;
+    previous        = paths_used;
+    previous_size   = length;
+    paths_used     += length + 1;
+    cursor          = nul + 1;
+  }
+
+  if (path_offsets) {
+    for (size_t i = 0; i < block->entry_count; i++) entries[i].path = block->paths + path_offsets[i];
+  }
+  block->end = cursor - index->map;
+  ok = 1;
+
+done:
+  free(path_offsets);
+  return ok;
+}
+
+
+/**
+ * Reads the extensions following the index entries. Of the optional
+ * ones (starting with an upper-case letter) only the root of the cache
+ * tree (TREE) is used: the tree the index would be written as, unless
+ * it has been invalidated. Required ones, such as split index (link) or
+ * sparse index (sdir), can't be ignored, so the index is left to
+ * libgit2.
+ *
+ * @param index:  The index; has_cache_tree and cache_tree_id are set.
+ * @param offset: Offset of the first extension.
+ *
+ * @return: 1 on success, 0 if the index has to be read by libgit2.
+ */
+int readIndexExtensions(struct NativeIndex *index, size_t offset) {
+  const size_t end = index->size - GIT_OID_RAWSZ;
+
+  while (offset + INDEX_EXTENSION_HEADER_SIZE <= end) {
+    const unsigned char *extension = index->map + offset;
+    const size_t size = readBigEndian32(extension + 4);
+    if (size > end - offset - INDEX_EXTENSION_HEADER_SIZE) return 0;
+    const unsigned char *data = extension + INDEX_EXTENSION_HEADER_SIZE;
+
+    if (memcmp(extension, "TREE", 4) == 0) {
+      // the root comes first: an empty path, "<entry count> <subtree
+      // count>\n" (-1 entries if invalid), and its object id
+      const unsigned char *newline = memchr(data, '\n', size);
+      if (size > 2 && data[0] == '\0' && data[1] != '-' && newline &&
+          (size_t) (data + size - newline - 1) >= GIT_OID_RAWSZ) {
+        memcpy(index->cache_tree_id.id, newline + 1, GIT_OID_RAWSZ);
+        index->has_cache_tree = 1;
+      }
+    }
+    else if (extension[0] < 'A' || extension[0] > 'Z') {
+      return 0;
+    }
+    offset += INDEX_EXTENSION_HEADER_SIZE + size;
+  }
+  return offset == end;
+}
+
+
+/**
+ * Counts the conflicted paths in a NativeIndex. Entries are sorted by
+ * path, then stage, so a path's conflict entries are next to each
+ * other. The blocks have already counted the entries, so the usual,
+ * conflict-free index is not walked again.
+ *
+ * @param index: The index.
+ *
+ * @return: The number of conflicted paths.
+ */
+int countNativeConflicts(const struct NativeIndex *index) {
+  if (index->conflict_entries == 0) return 0;
+
+  int count = 0;
+  const char *previous = NULL;
+  for (size_t i = 0; i < index->entry_count; i++) {
+    const git_index_entry *entry = &index->entries[i];
+    if (GIT_INDEX_ENTRY_STAGE(entry) == 0) continue;
+    if (!previous || strcmp(previous, entry->path) != 0) count++;
+    previous = entry->path;
+  }
+  return count;
+}
+
+
+/**
+ * Reads a big-endian 32-bit integer.
+ *
+ * @param bytes: The integer's four bytes.
+ *
+ * @return: The integer.
+ */
+uint32_t readBigEndian32(const unsigned char *bytes) {
+  return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | bytes[3];
+}
+
+
+/**
+ * Writes a big-endian 32-bit integer, as the index stores them.
+ *
+ * @param bytes: Where the integer's four bytes go.
+ * @param value: The integer.
+ */
+void writeBigEndian32(unsigned char *bytes, uint32_t value) {
+  bytes[0] = value >> 24;
+  bytes[1] = value >> 16;
+  bytes[2] = value >> 8;
+  bytes[3] = value;
+}
+
+
+/**
+ * Writes the current stat data of hashed files which turned out
+ * unchanged into .git/index, so later prompts (and git) don't hash them
+ * again. Like 'git update-index --refresh' this happens under
+ * index.lock, but only the stat fields of the entries are patched and
+ * the checksum redone: the index keeps its version and every extension
+ * (UNTR, FSMN, EOIE/IEOT, ...) as git wrote it.
+ *
+ * The new index is younger than the old one, so entries which were racy
+ * against the old one would look clean. Like git, they are smudged
+ * instead (given a zero size, which makes git compare the contents),
+ * and so are candidates which did not hash the same and files modified
+ * in the second the index is written.
+ *
+ * Nothing is written if the lock is taken, if the index changed since
+ * the entries were read from it, or if it isn't laid out as they say.
+ *
+ * @param index_path:  Path of the index file.
+ * @param entries:     The index entries the candidates point into.
+ * @param entry_count: Number of entries.
+ * @param candidates:  The hashed candidates, in index order.
+ * @param count:       Number of candidates.
+ * @param index_stat:  stat() data of the index file the entries were
+ *                     read from.
+ *
+ * @return: 1 if the index was written, 0 if not.
+ */
+int writeIndexStatData(const char *index_path,
+                       const git_index_entry *entries,
+                       size_t entry_count,
+                       const struct HashCandidate *candidates,
+                       size_t count,
+                       const struct stat *index_stat) {
+  char lock_path[MAX_PATH_BUFFER_SIZE];
+  const int length = snprintf(lock_path, sizeof(lock_path), "%s.lock", index_path);
+  if (length < 0 || (size_t) length >= sizeof(lock_path)) return 0;
+  int lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (lock_fd < 0) return 0;
+
+  // with index.lock held, git leaves the index alone
+  int            written = 0;
+  unsigned char *data    = NULL;
+  struct stat    current_stat;
+  const int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &current_stat) != 0                                   ||
+      GP_STAT_MTIME(current_stat).tv_sec  != GP_STAT_MTIME(*index_stat).tv_sec  ||
+      GP_STAT_MTIME(current_stat).tv_nsec != GP_STAT_MTIME(*index_stat).tv_nsec ||
+      current_stat.st_size                != index_stat->st_size                ||
+      current_stat.st_ino                 != index_stat->st_ino                 ||
+      current_stat.st_size < INDEX_HEADER_SIZE + GIT_OID_RAWSZ) {
+    goto done;
+  }
+  const size_t size = current_stat.st_size;
+  data = malloc(size);
+  size_t have = 0;
+  while (data && have < size) {
+    const ssize_t got = read(fd, data + have, size - have);
+    if (got <= 0) goto done;
+    have += got;
+  }
+  if (!data) goto done;
+
+  const uint32_t version = readBigEndian32(data + 4);
+  if (memcmp(data, "DIRC", 4) != 0 || version < 2 || version > 4 ||
+      readBigEndian32(data + 8) != entry_count) {
+    goto done;
+  }
+
+  const time_t now = time(NULL);
+  const unsigned char *end = data + size - GIT_OID_RAWSZ;
+  unsigned char *cursor = data + INDEX_HEADER_SIZE;
+  size_t next = 0;
+  for (size_t i = 0; i < entry_count; i++) {
+    if (end - cursor < INDEX_ENTRY_FIXED_SIZE) goto done;
+    unsigned char *start = cursor;
+    const uint32_t flags = (cursor[60] << 8) | cursor[61];
+
+    if (next < count && (size_t) (candidates[next].entry - entries) == i) {
+      // the candidate must describe this very entry
+      const struct HashCandidate *candidate = &candidates[next++];
+      const struct stat *file_stat = &candidate->file_stat;
+      if (memcmp(cursor + 40, candidate->entry->id.id, GIT_OID_RAWSZ) != 0 ||
+          readBigEndian32(cursor + 36) != candidate->entry->file_size) {
+        goto done;
+      }
+      if (candidate->result == HASH_MATCH && GP_STAT_MTIME(*file_stat).tv_sec < now) {
+        writeBigEndian32(cursor,      GP_STAT_CTIME(*file_stat).tv_sec);
+        writeBigEndian32(cursor + 4,  GP_STAT_CTIME(*file_stat).tv_nsec);
+        writeBigEndian32(cursor + 8,  GP_STAT_MTIME(*file_stat).tv_sec);
+        writeBigEndian32(cursor + 12, GP_STAT_MTIME(*file_stat).tv_nsec);
+        writeBigEndian32(cursor + 16, file_stat->st_dev);
+        writeBigEndian32(cursor + 20, file_stat->st_ino);
+        writeBigEndian32(cursor + 28, file_stat->st_uid);
+        writeBigEndian32(cursor + 32, file_stat->st_gid);
+        writeBigEndian32(cursor + 36, file_stat->st_size);
+      }
+      else {
+        writeBigEndian32(cursor + 36, 0);
+      }
+    }
+    else {
+      // racy as checkWorkdirNative() sees it; only entries it never got
+      // to (it stops at the first change) can be
+      const time_t   seconds     = readBigEndian32(cursor + 8);
+      const uint32_t nanoseconds = readBigEndian32(cursor + 12);
+      if (seconds > GP_STAT_MTIME(*index_stat).tv_sec ||
+          (seconds == GP_STAT_MTIME(*index_stat).tv_sec &&
+           nanoseconds >= (uint32_t) GP_STAT_MTIME(*index_stat).tv_nsec)) {
+        writeBigEndian32(cursor + 36, 0);
+      }
+    }
+
+    // step over the entry, as in parseIndexBlock()
+    cursor += INDEX_ENTRY_FIXED_SIZE;
+    if (flags & GIT_INDEX_ENTRY_EXTENDED) {
+      if (version < 3 || end - cursor < 2) goto done;
+      cursor += 2;
+    }
+    if (version < 4) {
+      size_t name_length = flags & INDEX_NAME_MASK;
+      if (name_length == INDEX_NAME_MASK) {
+        const unsigned char *nul = memchr(cursor, '\0', end - cursor);
+        if (!nul) goto done;
+        name_length = nul - cursor;
+      }
+      const size_t entry_size = (cursor - start + name_length + 8) & ~(size_t) 7;
+      if (entry_size > (size_t) (end - start)) goto done;
+      cursor = start + entry_size;
+    }
+    else {
+      uint64_t strip = 0;
+      const unsigned char *suffix = readReftableVarint(cursor, end, &strip);
+      const unsigned char *nul    = suffix ? memchr(suffix, '\0', end - suffix) : NULL;
+      if (!nul) goto done;
+      cursor = (unsigned char *) nul + 1;
+    }
+  }
+  if (next != count) goto done;
+
+  // index.skipHash leaves the checksum zeroed
+  static const unsigned char no_checksum[GIT_OID_RAWSZ];
+  if (memcmp(end, no_checksum, GIT_OID_RAWSZ) != 0) {
+    struct Sha1Context context;
+    sha1Init(&context, selectSha1Compress());
+    sha1Update(&context, data, size - GIT_OID_RAWSZ);
+    sha1Final(&context, data + size - GIT_OID_RAWSZ);
+  }
+
+  for (have = 0; have < size; ) {
+    const ssize_t put = write(lock_fd, data + have, size - have);
+    if (put <= 0) goto done;
+    have += put;
+  }
+  const int closed = close(lock_fd);
+  lock_fd = -1;
+  written = closed == 0 && rename(lock_path, index_path) == 0;
+
+done:
+  if (fd >= 0) close(fd);
+  if (lock_fd >= 0) close(lock_fd);
+  if (!written) unlink(lock_path);
+  free(data);
+  return written;
+}
@@ -0,0 +1,114 @@
+/* --------------------------------------------------
+ * Reading .git/index without libgit2, and writing refreshed stat data
+ * back into it. See index.c.
+ *
+ * Only libgit2's types and constants are used here, none of its
+ * functions, so this works before (or without) libgit2 being opened.
+ */
+#ifndef GENERATE_PROMPT_INDEX_H
+#define GENERATE_PROMPT_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <git2.h>
+
+// .git/index layout, see git's Documentation/gitformat-index.txt, and
+// how many threads parse it, see loadNativeIndex()
+#define INDEX_HEADER_SIZE             12
+#define INDEX_ENTRY_FIXED_SIZE        62
+#define INDEX_EXTENSION_HEADER_SIZE   8
+#define INDEX_EOIE_SIZE               (INDEX_EXTENSION_HEADER_SIZE + 4 + GIT_OID_RAWSZ)
+#define INDEX_NAME_MASK               0x0fff
+#define MAX_INDEX_THREADS             8
+
+// the result of hashing a HashCandidate
+enum hash_results {
+  HASH_PENDING  = 0,
+  HASH_MATCH    = 1,
+  HASH_MISMATCH = 2,
+  HASH_FAILED   = 3,
+  HASH_FILTERED = 4,  // the bytes match, but filters apply to the file
+};
+
+// a working-directory file whose stat data does not match the index,
+// so only its contents can tell whether it changed
+struct HashCandidate {
+  const git_index_entry *entry;
+  struct stat            file_stat;
+  int                    result;
+};
+
+// a run of index entries which can be parsed on its own; the whole
+// index, or one entry of its IEOT extension
+struct IndexBlock {
+  size_t  offset;
+  size_t  first_entry;
+  size_t  entry_count;
+  size_t  end;            // offset just past the block, once parsed
+  char   *paths;          // index v4 only: the block's decompressed paths
+  size_t  conflict_entries;
+  int     intent_to_add;
+  int     failed;
+};
+
+// a .git/index parsed without libgit2, see loadNativeIndex(). With
+// index v2/v3 the entry paths point into the mapped file.
+struct NativeIndex {
+  unsigned char     *map;
+  size_t             size;
+  unsigned int       version;
+  struct stat        file_stat;
+  git_index_entry   *entries;
+  size_t             entry_count;
+  struct IndexBlock *blocks;
+  size_t             block_count;
+  size_t             next_block;   // next block to claim, atomically
+  size_t             conflict_entries;
+  int                intent_to_add;
+  int                has_cache_tree;
+  git_oid            cache_tree_id;
+};
+
+
+/* --------------------------------------------------
+ * Declarations
+ * For detailed descriptions, see the function definitions in index.c.
+ */
+
+// Maps and parses .git/index without libgit2.
+int loadNativeIndex(const char *path, struct NativeIndex *index);
+
+// Releases a NativeIndex.
+void freeNativeIndex(struct NativeIndex *index);
+
+// Splits a NativeIndex into the blocks listed by its IEOT extension.
+int readIndexOffsetTable(struct NativeIndex *index, size_t extensions);
+
+// Task which parses IndexBlocks until none are left.
+void runIndexParseTask(void *argument);
+
+// Parses the entries of one IndexBlock.
+int parseIndexBlock(struct NativeIndex *index, struct IndexBlock *block);
+
+// Reads the extensions following the index entries.
+int readIndexExtensions(struct NativeIndex *index, size_t offset);
+
+// Counts the conflicted paths in a NativeIndex.
+int countNativeConflicts(const struct NativeIndex *index);
+
+// Reads a big-endian 32-bit integer.
+uint32_t readBigEndian32(const unsigned char *bytes);
+
+// Writes a big-endian 32-bit integer.
+void writeBigEndian32(unsigned char *bytes, uint32_t value);
+
+// Writes refreshed stat data into .git/index in place, under index.lock.
+int writeIndexStatData(const char *index_path,
+                       const git_index_entry *entries,
+                       size_t entry_count,
+                       const struct HashCandidate *candidates,
+                       size_t count,
+                       const struct stat *index_stat);
+
+#endif
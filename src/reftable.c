@@ -0,0 +1,336 @@
+/* --------------------------------------------------
+ * Includes
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "reftable.h"
+
+
+/* --------------------------------------------------
+ * Functions
+ */
+
+/**
+ * Looks up a ref in a reftable stack. The tables listed in
+ * 'tables.list' are searched from newest to oldest, and the first
+ * table which has a record for the ref (including a deletion) wins.
+ *
+ * @param reftable_dir: The reftable directory, e.g. ".git/reftable".
+ * @param ref_name:     Full name of the ref, e.g. "refs/heads/main".
+ * @param value:        Output buffer (MAX_REF_LINE_BUFFER_SIZE) which
+ *                      receives the ref like a loose ref file would
+ *                      hold it: an object id or "ref: <target>".
+ *
+ * @return Returns 1 if found, 0 if not, and -1 on malformed input.
+ */
+int lookupReftableRef(const char *reftable_dir, const char *ref_name, char *value) {
+  char path[MAX_PATH_BUFFER_SIZE + MAX_REF_LINE_BUFFER_SIZE];
+  snprintf(path, sizeof(path), "%s/tables.list", reftable_dir);
+
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  char *tables = malloc(st.st_size + 1);
+  const ssize_t length = read(fd, tables, st.st_size);
+  close(fd);
+  if (length != st.st_size) {
+    free(tables);
+    return -1;
+  }
+  tables[length] = '\0';
+
+  // newest table is listed last
+  int found = 0;
+  char *table_end = tables + length;
+  while (found == 0 && table_end > tables) {
+    while (table_end > tables && table_end[-1] == '\n') *--table_end = '\0';
+    char *table = table_end;
+    while (table > tables && table[-1] != '\n') table--;
+    if (table == table_end) break;
+
+    snprintf(path, sizeof(path), "%s/%s", reftable_dir, table);
+    found = searchReftable(path, ref_name, value);
+    table_end = table;
+  }
+
+  free(tables);
+
+  // 2 means the newest record for the ref is a deletion
+  return found == 2 ? 0 : found;
+}
+
+
+/**
+ * Looks up a ref in a single reftable file. If the table has a ref
+ * index, it is used to go straight to the right ref block; otherwise
+ * the ref blocks are searched in order. Within a block, the restart
+ * points are binary-searched.
+ *
+ * @param path:     Path of the table.
+ * @param ref_name: Full name of the ref.
+ * @param value:    Output buffer, see lookupReftableRef().
+ *
+ * @return Returns 1 if found, 2 if the ref is deleted in this table,
+ *         0 if the table has no record for it, and -1 on malformed
+ *         input.
+ */
+int searchReftable(const char *path, const char *ref_name, char *value) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < REFTABLE_V1_HEADER_SIZE) {
+    close(fd);
+    return -1;
+  }
+  const size_t size = st.st_size;
+  const unsigned char *table = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (table == MAP_FAILED) return -1;
+
+  int result = -1;
+  struct ReftableRecord record;
+
+  // header: 'REFT', version, uint24 block_size, ... (version 2 adds a
+  // hash id)
+  const int version = table[4];
+  const size_t header_size = version == 1 ? REFTABLE_V1_HEADER_SIZE : REFTABLE_V2_HEADER_SIZE;
+  const size_t footer_size = header_size + REFTABLE_FOOTER_EXTRA_SIZE;
+  const size_t block_size = (table[5] << 16) | (table[6] << 8) | table[7];
+  const int hash_size = (version == 2 && memcmp(table + 24, "s256", 4) == 0) ? 32 : 20;
+  if (memcmp(table, "REFT", 4) != 0 || (version != 1 && version != 2) || size < header_size + footer_size) {
+    goto done;
+  }
+
+  // the footer repeats the header, followed by ref_index_position
+  const size_t footer = size - footer_size;
+  uint64_t ref_index_position = 0;
+  for (int i = 0; i < 8; i++) ref_index_position = (ref_index_position << 8) | table[footer + header_size + i];
+
+  size_t block = 0;
+  while (ref_index_position != 0) {
+    // walk down the (possibly multi-level) index to the ref block
+    if (ref_index_position + 4 > footer || table[ref_index_position] != 'i') goto done;
+    const size_t index_end = ref_index_position + ((table[ref_index_position + 1] << 16) |
+                                                   (table[ref_index_position + 2] << 8) |
+                                                    table[ref_index_position + 3]);
+    const int seek = seekReftableBlock(table, ref_index_position, 0, index_end, hash_size, ref_name, &record);
+    if (seek <= 0) {
+      result = seek;
+      goto done;
+    }
+
+    uint64_t child = 0;
+    if (readReftableVarint(record.value, table + index_end, &child) == NULL || child >= footer) goto done;
+    ref_index_position = table[child] == 'i' ? child : 0;
+    block = child;
+  }
+
+  // ref blocks are stored first; the first one shares its space with
+  // the file header
+  while (block < footer) {
+    const size_t header_offset = block == 0 ? header_size : 0;
+    const unsigned char *block_header = table + block + header_offset;
+    if (block + header_offset + 4 > footer || block_header[0] != 'r') {
+      result = 0;
+      goto done;
+    }
+
+    const size_t block_end = block + ((block_header[1] << 16) | (block_header[2] << 8) | block_header[3]);
+    const int seek = seekReftableBlock(table, block, header_offset, block_end, hash_size, ref_name, &record);
+    if (seek < 0) goto done;
+    if (seek == 1) {
+      if (strcmp(record.key, ref_name) != 0) {
+        result = 0;
+      }
+      else if (record.value_type == 0) {
+        result = 2;
+      }
+      else if (record.value_type == 3) {
+        uint64_t target_length = 0;
+        const unsigned char *target = readReftableVarint(record.value, table + block_end, &target_length);
+        if (target == NULL || target_length + 6 > MAX_REF_LINE_BUFFER_SIZE) goto done;
+        snprintf(value, MAX_REF_LINE_BUFFER_SIZE, "ref: %.*s", (int) target_length, target);
+        result = 1;
+      }
+      else if (hash_size == 20) {
+        for (int i = 0; i < 20; i++) sprintf(value + 2 * i, "%02x", record.value[i]);
+        result = 1;
+      }
+      goto done;
+    }
+
+    // every key in this block sorts before the ref; try the next one
+    block = block_size ? (block_end + block_size - 1) / block_size * block_size : block_end;
+  }
+  result = 0;
+
+done:
+  munmap((void *) table, size);
+  return result;
+}
+
+
+/**
+ * Finds the first record in a reftable block whose key sorts at or
+ * after 'key'. The block's restart points (records stored without
+ * prefix compression) are binary-searched, and the records following
+ * the chosen restart point are decoded one by one.
+ *
+ * @param table:         The mmap'd table.
+ * @param block_start:   Offset of the block; restart offsets are
+ *                       relative to this.
+ * @param header_offset: Offset of the block header within the block
+ *                       (non-zero only for the first block).
+ * @param block_end:     Offset just past the block's restart table.
+ * @param hash_size:     Size of object ids in this table.
+ * @param key:           The key to look for.
+ * @param record:        Receives the record found.
+ *
+ * @return Returns 1 if a record was found, 0 if every key in the block
+ *         sorts before 'key', and -1 on malformed input.
+ */
+int seekReftableBlock(const unsigned char *table,
+                      size_t block_start,
+                      size_t header_offset,
+                      size_t block_end,
+                      int hash_size,
+                      const char *key,
+                      struct ReftableRecord *record) {
+  const unsigned char *block = table + block_start;
+  const size_t length = block_end - block_start;
+  if (block_end <= block_start || length < header_offset + 6) return -1;
+
+  const char block_type = block[header_offset];
+  const int restart_count = (block[length - 2] << 8) | block[length - 1];
+  const unsigned char *restarts = block + length - 2 - 3 * restart_count;
+  if (restart_count == 0 || restarts < block + header_offset + 4) return -1;
+
+  // find the last restart point whose key sorts before 'key'
+  int lo = 0;
+  int hi = restart_count;
+  size_t start = header_offset + 4;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    const size_t offset = (restarts[3 * mid] << 16) | (restarts[3 * mid + 1] << 8) | restarts[3 * mid + 2];
+    record->key_length = 0;
+    if (offset >= length || decodeReftableRecord(block + offset, restarts, block_type, hash_size, record) < 0) return -1;
+
+    if (strcmp(record->key, key) < 0) {
+      start = offset;
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  // then scan forward from it
+  record->key_length = 0;
+  for (const unsigned char *cursor = block + start; cursor < restarts; cursor = record->next) {
+    if (decodeReftableRecord(cursor, restarts, block_type, hash_size, record) < 0) return -1;
+    if (strcmp(record->key, key) >= 0) return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Decodes one reftable record. Keys are prefix-compressed against the
+ * previous record, so 'record' must hold the previous record's key
+ * (or have a key_length of 0 at a restart point).
+ *
+ * @param cursor:     Start of the record.
+ * @param end:        End of the record area of the block.
+ * @param block_type: 'r' for ref blocks, 'i' for index blocks.
+ * @param hash_size:  Size of object ids in this table.
+ * @param record:     Receives key, value type, value and the position
+ *                    of the next record.
+ *
+ * @return Returns 0 on success, or -1 on malformed input.
+ */
+int decodeReftableRecord(const unsigned char *cursor,
+                         const unsigned char *end,
+                         char block_type,
+                         int hash_size,
+                         struct ReftableRecord *record) {
+  uint64_t prefix_length = 0;
+  uint64_t suffix_and_type = 0;
+  if ((cursor = readReftableVarint(cursor, end, &prefix_length)) == NULL ||
+      (cursor = readReftableVarint(cursor, end, &suffix_and_type)) == NULL) {
+    return -1;
+  }
+
+  const uint64_t suffix_length = suffix_and_type >> 3;
+  if (prefix_length > record->key_length ||
+      prefix_length + suffix_length >= sizeof(record->key) ||
+      suffix_length > (uint64_t) (end - cursor)) {
+    return -1;
+  }
+  memcpy(record->key + prefix_length, cursor, suffix_length);
+  record->key_length = prefix_length + suffix_length;
+  record->key[record->key_length] = '\0';
+  record->value_type = suffix_and_type & 0x7;
+  cursor += suffix_length;
+
+  // ref records carry an update index before the value
+  uint64_t skip = 0;
+  if (block_type == 'r' && (cursor = readReftableVarint(cursor, end, &skip)) == NULL) return -1;
+  record->value = cursor;
+
+  switch (block_type == 'r' ? record->value_type : -1) {
+    case 0:  skip = 0;             break;
+    case 1:  skip = hash_size;     break;
+    case 2:  skip = 2 * hash_size; break;
+    case 3:
+      if ((cursor = readReftableVarint(cursor, end, &skip)) == NULL) return -1;
+      break;
+    case -1:
+      // index records: the value is a block position
+      if ((cursor = readReftableVarint(cursor, end, &skip)) == NULL) return -1;
+      skip = 0;
+      break;
+    default:
+      return -1;
+  }
+  if (skip > (uint64_t) (end - cursor)) return -1;
+  record->next = cursor + skip;
+  return 0;
+}
+
+
+/**
+ * Reads a reftable varint (the same encoding git uses for offsets in
+ * pack files: each continuation byte adds one before shifting).
+ *
+ * @param cursor: Start of the varint.
+ * @param end:    End of the readable area.
+ * @param value:  Receives the decoded value.
+ *
+ * @return Returns a pointer to the byte after the varint, or NULL if it
+ *         runs past 'end'.
+ */
+const unsigned char *readReftableVarint(const unsigned char *cursor,
+                                        const unsigned char *end,
+                                        uint64_t *value) {
+  if (cursor >= end) return NULL;
+  uint64_t result = *cursor & 0x7f;
+  while (*cursor++ & 0x80) {
+    if (cursor >= end) return NULL;
+    result = ((result + 1) << 7) | (*cursor & 0x7f);
+  }
+  *value = result;
+  return cursor;
+}
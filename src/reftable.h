@@ -0,0 +1,60 @@
+/* --------------------------------------------------
+ * Reading refs from a reftable stack without libgit2. See reftable.c.
+ */
+#ifndef GENERATE_PROMPT_REFTABLE_H
+#define GENERATE_PROMPT_REFTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// reftable file layout, see git's Documentation/technical/reftable.txt
+#define REFTABLE_V1_HEADER_SIZE       24
+#define REFTABLE_V2_HEADER_SIZE       28
+#define REFTABLE_FOOTER_EXTRA_SIZE    44
+
+// a single decoded record from a reftable block
+struct ReftableRecord {
+  char                 key[MAX_REF_LINE_BUFFER_SIZE];
+  size_t               key_length;
+  int                  value_type;
+  const unsigned char *value;
+  const unsigned char *next;
+};
+
+
+/* --------------------------------------------------
+ * Declarations
+ * For detailed descriptions, see the function definitions in
+ * reftable.c.
+ */
+
+// Looks up a ref in a reftable stack (newest table first).
+int lookupReftableRef(const char *reftable_dir, const char *ref_name, char *value);
+
+// Looks up a ref in a single reftable file.
+int searchReftable(const char *path, const char *ref_name, char *value);
+
+// Finds the first record in a reftable block whose key is >= 'key'.
+int seekReftableBlock(const unsigned char *table,
+                      size_t block_start,
+                      size_t header_offset,
+                      size_t block_end,
+                      int hash_size,
+                      const char *key,
+                      struct ReftableRecord *record);
+
+// Decodes one prefix-compressed reftable record.
+int decodeReftableRecord(const unsigned char *cursor,
+                         const unsigned char *end,
+                         char block_type,
+                         int hash_size,
+                         struct ReftableRecord *record);
+
+// Reads a reftable varint.
+const unsigned char *readReftableVarint(const unsigned char *cursor,
+                                        const unsigned char *end,
+                                        uint64_t *value);
+
+#endif
@@ -0,0 +1,214 @@
+/* --------------------------------------------------
+ * Includes
+ */
+#include <string.h>
+
+#include "sha1.h"
+
+#ifdef HAVE_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+
+/* --------------------------------------------------
+ * Functions
+ */
+
+/**
+ * Returns the fastest SHA-1 block function this CPU supports: the x86
+ * SHA extensions if present, the portable one otherwise.
+ *
+ * @return: The block function.
+ */
+Sha1Compress selectSha1Compress(void) {
+#ifdef HAVE_SHA_NI
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+      (ecx & bit_SSSE3) && (ecx & bit_SSE4_1) &&
+      __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+      (ebx & bit_SHA)) {
+    return sha1CompressShaNi;
+  }
+#endif
+  return sha1CompressPortable;
+}
+
+
+/**
+ * Starts a SHA-1.
+ *
+ * @param context:  The context to initialize.
+ * @param compress: The block function to use.
+ */
+void sha1Init(struct Sha1Context *context, Sha1Compress compress) {
+  context->state[0] = 0x67452301;
+  context->state[1] = 0xEFCDAB89;
+  context->state[2] = 0x98BADCFE;
+  context->state[3] = 0x10325476;
+  context->state[4] = 0xC3D2E1F0;
+  context->length   = 0;
+  context->buffered = 0;
+  context->compress = compress;
+}
+
+
+/**
+ * Adds data to a SHA-1. Whole blocks are passed to the block function
+ * straight from 'data', without copying.
+ *
+ * @param context: The SHA-1.
+ * @param data:    The data.
+ * @param length:  Number of bytes in 'data'.
+ */
+void sha1Update(struct Sha1Context *context, const void *data, size_t length) {
+  const unsigned char *bytes = data;
+  context->length += length;
+
+  if (context->buffered) {
+    size_t take = 64 - context->buffered;
+    if (take > length) take = length;
+    memcpy(context->buffer + context->buffered, bytes, take);
+    context->buffered += take;
+    bytes  += take;
+    length -= take;
+    if (context->buffered < 64) return;
+    context->compress(context->state, context->buffer, 1);
+    context->buffered = 0;
+  }
+
+  if (length >= 64) {
+    context->compress(context->state, bytes, length / 64);
+    bytes  += length & ~(size_t) 63;
+    length &= 63;
+  }
+
+  memcpy(context->buffer, bytes, length);
+  context->buffered = length;
+}
+
+
+/**
+ * Finishes a SHA-1.
+ *
+ * @param context: The SHA-1.
+ * @param digest:  Output, the 20-byte digest.
+ */
+void sha1Final(struct Sha1Context *context, unsigned char digest[SHA1_DIGEST_SIZE]) {
+  const uint64_t bits = context->length * 8;
+  unsigned char padding[72] = { 0x80 };
+  const size_t padding_length = (context->buffered < 56 ? 56 : 120) - context->buffered;
+  for (int i = 0; i < 8; i++) padding[padding_length + i] = bits >> (56 - 8 * i);
+  sha1Update(context, padding, padding_length + 8);
+
+  for (int i = 0; i < 5; i++) {
+    digest[4 * i]     = context->state[i] >> 24;
+    digest[4 * i + 1] = context->state[i] >> 16;
+    digest[4 * i + 2] = context->state[i] >> 8;
+    digest[4 * i + 3] = context->state[i];
+  }
+}
+
+
+/**
+ * Portable SHA-1 block function (FIPS 180-4).
+ *
+ * @param state:  The SHA-1 state.
+ * @param blocks: 'count' 64-byte blocks.
+ * @param count:  Number of blocks.
+ */
+void sha1CompressPortable(uint32_t state[5], const unsigned char *blocks, size_t count) {
+  #define ROTATE_LEFT(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+  for (; count > 0; count--, blocks += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t) blocks[4 * i] << 24 | (uint32_t) blocks[4 * i + 1] << 16 |
+             (uint32_t) blocks[4 * i + 2] << 8 | blocks[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) w[i] = ROTATE_LEFT(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    #define SHA1_ROUND(f, k, i) do {                                    \
+      const uint32_t temp = ROTATE_LEFT(a, 5) + (f) + e + (k) + w[i];   \
+      e = d;                                                            \
+      d = c;                                                            \
+      c = ROTATE_LEFT(b, 30);                                           \
+      b = a;                                                            \
+      a = temp;                                                         \
+    } while (0)
+    for (int i = 0;  i < 20; i++) SHA1_ROUND(d ^ (b & (c ^ d)),       0x5A827999, i);
+    for (int i = 20; i < 40; i++) SHA1_ROUND(b ^ c ^ d,               0x6ED9EBA1, i);
+    for (int i = 40; i < 60; i++) SHA1_ROUND((b & c) | (d & (b | c)), 0x8F1BBCDC, i);
+    for (int i = 60; i < 80; i++) SHA1_ROUND(b ^ c ^ d,               0xCA62C1D6, i);
+    #undef SHA1_ROUND
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+
+  #undef ROTATE_LEFT
+}
+
+
+#ifdef HAVE_SHA_NI
+/**
+ * SHA-1 block function using the x86 SHA extensions. Four rounds per
+ * instruction; the message schedule is computed alongside, four words
+ * at a time.
+ *
+ * @param state:  The SHA-1 state.
+ * @param blocks: 'count' 64-byte blocks.
+ * @param count:  Number of blocks.
+ */
+__attribute__((target("sha,ssse3,sse4.1")))
+void sha1CompressShaNi(uint32_t state[5], const unsigned char *blocks, size_t count) {
+  const __m128i byte_swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+  __m128i e0   = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for (; count > 0; count--, blocks += 64) {
+    const __m128i abcd_save = abcd;
+    const __m128i e0_save   = e0;
+    __m128i message[4];
+    __m128i e[2] = { e0, e0 };
+
+    // round group g is rounds 4g..4g+3; e[g & 1] feeds it and
+    // e[(g + 1) & 1] keeps abcd for the next one
+    #pragma GCC unroll 20
+    for (int g = 0; g < 20; g++) {
+      __m128i *current = &e[g & 1];
+      if (g < 4) {
+        message[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (blocks + 16 * g)), byte_swap);
+      }
+      *current = g == 0 ? _mm_add_epi32(*current, message[0])
+                        : _mm_sha1nexte_epu32(*current, message[g & 3]);
+      e[(g + 1) & 1] = abcd;
+      if (g >= 3 && g <= 18) {
+        message[(g + 1) & 3] = _mm_sha1msg2_epu32(message[(g + 1) & 3], message[g & 3]);
+      }
+      switch (g / 5) {
+        case 0:  abcd = _mm_sha1rnds4_epu32(abcd, *current, 0); break;
+        case 1:  abcd = _mm_sha1rnds4_epu32(abcd, *current, 1); break;
+        case 2:  abcd = _mm_sha1rnds4_epu32(abcd, *current, 2); break;
+        default: abcd = _mm_sha1rnds4_epu32(abcd, *current, 3); break;
+      }
+      if (g >= 1 && g <= 16) {
+        message[(g - 1) & 3] = _mm_sha1msg1_epu32(message[(g - 1) & 3], message[g & 3]);
+      }
+      if (g >= 2 && g <= 17) {
+        message[(g - 2) & 3] = _mm_xor_si128(message[(g - 2) & 3], message[g & 3]);
+      }
+    }
+
+    e0   = _mm_sha1nexte_epu32(e[0], e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
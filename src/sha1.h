@@ -0,0 +1,57 @@
+/* --------------------------------------------------
+ * SHA-1, for hashing working-directory files as git blobs without
+ * libgit2. See sha1.c.
+ */
+#ifndef GENERATE_PROMPT_SHA1_H
+#define GENERATE_PROMPT_SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-NI is used for hashing when the CPU has it
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SHA_NI 1
+#endif
+
+// size of a SHA-1 digest (GIT_OID_RAWSZ, without needing git2.h)
+#define SHA1_DIGEST_SIZE 20
+
+// compresses 'count' 64-byte blocks into a SHA-1 state
+typedef void (*Sha1Compress)(uint32_t state[5], const unsigned char *blocks, size_t count);
+
+// a running SHA-1
+struct Sha1Context {
+  uint32_t      state[5];
+  uint64_t      length;
+  unsigned char buffer[64];
+  size_t        buffered;
+  Sha1Compress  compress;
+};
+
+
+/* --------------------------------------------------
+ * Declarations
+ * For detailed descriptions, see the function definitions in sha1.c.
+ */
+
+// Returns the fastest SHA-1 block function this CPU supports.
+Sha1Compress selectSha1Compress(void);
+
+// Starts a SHA-1.
+void sha1Init(struct Sha1Context *context, Sha1Compress compress);
+
+// Adds data to a SHA-1.
+void sha1Update(struct Sha1Context *context, const void *data, size_t length);
+
+// Finishes a SHA-1.
+void sha1Final(struct Sha1Context *context, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+// Portable SHA-1 block function.
+void sha1CompressPortable(uint32_t state[5], const unsigned char *blocks, size_t count);
+
+#ifdef HAVE_SHA_NI
+// SHA-1 block function using the x86 SHA extensions.
+void sha1CompressShaNi(uint32_t state[5], const unsigned char *blocks, size_t count);
+#endif
+
+#endif
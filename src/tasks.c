@@ -0,0 +1,51 @@
+/* --------------------------------------------------
+ * Includes
+ */
+#include <pthread.h>
+
+#include "tasks.h"
+
+
+/* --------------------------------------------------
+ * Functions
+ */
+
+/**
+ * A very small task scheduler: every task but the first gets its own
+ * thread, the first one runs on the calling thread, and the call
+ * returns once all of them are done. If a thread can't be created,
+ * that task runs on the calling thread instead.
+ *
+ * @param tasks: The tasks to run.
+ * @param count: Number of tasks.
+ */
+void runTasks(struct Task *tasks, int count) {
+  for (int i = 1; i < count; i++) {
+    tasks[i].on_thread = pthread_create(&tasks[i].thread, NULL, runTaskThread, &tasks[i]) == 0;
+  }
+
+  if (count > 0) tasks[0].run(tasks[0].argument);
+
+  for (int i = 1; i < count; i++) {
+    if (tasks[i].on_thread) {
+      pthread_join(tasks[i].thread, NULL);
+    }
+    else {
+      tasks[i].run(tasks[i].argument);
+    }
+  }
+}
+
+
+/**
+ * pthread entry point for runTasks().
+ *
+ * @param argument: Pointer to the Task to run.
+ *
+ * @return Always NULL.
+ */
+void *runTaskThread(void *argument) {
+  struct Task *task = argument;
+  task->run(task->argument);
+  return NULL;
+}
@@ -0,0 +1,29 @@
+/* --------------------------------------------------
+ * Running independent pieces of work on threads. See tasks.c.
+ */
+#ifndef GENERATE_PROMPT_TASKS_H
+#define GENERATE_PROMPT_TASKS_H
+
+#include <pthread.h>
+
+// a unit of work for runTasks()
+struct Task {
+  void      (*run)(void *argument);
+  void       *argument;
+  pthread_t   thread;
+  int         on_thread;
+};
+
+
+/* --------------------------------------------------
+ * Declarations
+ * For detailed descriptions, see the function definitions in tasks.c.
+ */
+
+// Runs tasks concurrently, each on its own thread, and waits for them.
+void runTasks(struct Task *tasks, int count);
+
+// pthread entry point for runTasks().
+void *runTaskThread(void *argument);
+
+#endif
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Regenerates the reftable stack in this directory with git itself
+# (git 2.45 or later), for the "ref-only prompt reads a reftable stack"
+# test:
+#
+#   test/fixtures/reftable/generate.sh
+#
+# The stack ends up with
+# - a table holding main, featureBranch, branch-000..branch-199 and
+#   tag-00..tag-19, in 1 KiB blocks so that git also writes an index
+#   block for them
+# - a table pointing HEAD at featureBranch
+# - a newest table with a deletion record for branch-007
+# Auto-compaction is off, so the deletion record is kept.
+set -e
+
+fixture=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+git init -q --ref-format=reftable --initial-branch=main "$work/repo"
+cd "$work/repo"
+git config reftable.autoCompaction false
+git config reftable.blockSize 1024
+git -c user.name=fixture -c user.email=fixture@example.com commit -q --allow-empty -m fixture
+
+commit=$(git rev-parse HEAD)
+{
+  echo "start"
+  echo "create refs/heads/featureBranch $commit"
+  for i in $(seq -w 0 199); do echo "create refs/heads/branch-$i $commit"; done
+  for i in $(seq -w 0 19);  do echo "create refs/tags/tag-$i $commit"; done
+  echo "commit"
+} | git update-ref --stdin
+
+git symbolic-ref HEAD refs/heads/featureBranch
+git update-ref -d refs/heads/branch-007
+
+rm -f "$fixture"/*.ref "$fixture"/tables.list
+cp .git/reftable/* "$fixture"/
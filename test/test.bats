@@ -36,6 +36,19 @@ helper__new_repo_and_commit() {
 }
 
 
+helper__assert_same_as_serial() {
+  # runs a prompt using every instruction, with and without GP_SERIAL,
+  # and checks that the output is identical
+  export GP_GIT_PROMPT="R:\\pR:L:\\pL:C:\\pC:K:\\pK:d:\\pd:a:\\pa:b:\\pb:u:\\pu:w:\\pw:m:\\pm:i:\\pi:P:\\pP"
+
+  serial_output=$(GP_SERIAL=1 $GENERATE_PROMPT)
+  concurrent_output=$($GENERATE_PROMPT)
+
+  echo -e "Serial:     $serial_output" >&2
+  echo -e "Concurrent: $concurrent_output" >&2
+  [ "$serial_output" = "$concurrent_output" ]
+}
+
 
 # Binary to test
 GENERATE_PROMPT="$BATS_TEST_DIRNAME/../bin/generate-prompt"
@@ -66,6 +79,16 @@ setup () {
   unset GP_A_DIVERGENCE_STYLE
   unset GP_B_DIVERGENCE_STYLE
   unset GP_AB_DIVERGENCE_STYLE
+  unset GP_U_DIVERGENCE_STYLE
+  unset GP_W_DIVERGENCE_STYLE
+  unset GP_M_DIVERGENCE_STYLE
+  unset GP_MAINLINE_REF
+
+  # concurrency; keeps the single-flight files inside the test repos
+  unset GP_SERIAL
+  unset GP_SINGLE_FLIGHT_WAIT_MS
+  unset GP_REFRESH_INDEX
+  unset XDG_RUNTIME_DIR
 
 
   # colour codes used by all tests
@@ -671,6 +694,817 @@ teardown () {
 }
 
 
+# --------------------------------------------------
+@test "ref-only prompt is the same as the libgit2 prompt" {
+  # given we have a git repo with a commit
+  helper__new_repo_and_commit "newfile" "some text"
+
+  # when we run a prompt which only needs ref names, and the same
+  # prompt with an instruction which needs libgit2 (\pk is empty when
+  # there are no conflicts)
+  export GP_GIT_PROMPT="\\pr:\\pl:\\pc:"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+  ref_only_output="$output"
+
+  export GP_GIT_PROMPT="\\pr:\\pl:\\pc:\\pk"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then both should be the same
+  repo=$(basename $(git rev-parse --show-toplevel))
+  wd=$(basename $PWD)
+  echo -e "Ref-only: $ref_only_output" >&2
+  echo -e "libgit2:  $output" >&2
+
+  [ "$ref_only_output" = "${repo}:main:${wd}:" ]
+  [ "$ref_only_output" = "$output" ]
+}
+
+
+# --------------------------------------------------
+@test "ref-only prompt does not load libgit2" {
+  # LD_DEBUG is glibc's
+  if ! LD_DEBUG=help /bin/true 2>&1 | grep -q files; then
+    skip "needs the glibc dynamic loader"
+  fi
+
+  # given we have a git repo with a commit
+  helper__new_repo_and_commit "newfile" "some text"
+
+  # when we run a prompt which only needs ref names
+  export GP_GIT_PROMPT="\\pr:\\pl:\\pc:"
+  ref_only_loads=$(LD_DEBUG=files $GENERATE_PROMPT 2>&1 >/dev/null | grep -c 'file=libgit2' || true)
+
+  # and a prompt which needs the status
+  export GP_GIT_PROMPT="\\pR:\\pl:\\pc:"
+  status_loads=$(LD_DEBUG=files $GENERATE_PROMPT 2>&1 >/dev/null | grep -c 'file=libgit2' || true)
+
+  # then only the second one loads libgit2
+  echo -e "Ref-only: $ref_only_loads" >&2
+  echo -e "Status:   $status_loads" >&2
+  [ "$ref_only_loads" -eq 0 ]
+  [ "$status_loads" -gt 0 ]
+}
+
+
+# --------------------------------------------------
+@test "ref-only prompt reads packed refs and detached HEAD" {
+  # given we have a git repo where all refs are packed
+  helper__new_repo_and_commit "newfile" "some text"
+  git checkout -b featureBranch
+  git pack-refs --all
+  [ ! -e .git/refs/heads/featureBranch ]
+
+  # when we run a prompt which only needs ref names
+  export GP_GIT_PROMPT="\\pl"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the branch is found in packed-refs
+  [ "$output" = "featureBranch" ]
+
+  # given we detach HEAD
+  git checkout --detach
+
+  # when we run the prompt again
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the branch shows as HEAD, same as git_reference_shorthand()
+  [ "$output" = "HEAD" ]
+}
+
+
+# --------------------------------------------------
+@test "ref-only prompt in empty git repository shows default prompt" {
+  # given we create a repo - and we do nothing more
+  helper__new_repo
+
+  # when we run a prompt which only needs ref names
+  export GP_GIT_PROMPT="\\pr:\\pl"
+  run -${EXIT_NO_LOCAL_REF} $GENERATE_PROMPT
+
+  # then it should behave as in a normal non-git repo
+  [ "$output" =  "\\W $ " ]
+}
+
+
+# --------------------------------------------------
+@test "ref-only prompt in a linked worktree" {
+  # given we have a git repo with a linked worktree
+  mkdir myRepo
+  cd myRepo
+  helper__new_repo_and_commit "newfile" "some text"
+  git worktree add ../myWorktree
+  cd ../myWorktree
+
+  # when we run a prompt which only needs ref names, and the same
+  # prompt with an instruction which needs libgit2
+  export GP_GIT_PROMPT="\\pr:\\pl:\\pc:"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+  ref_only_output="$output"
+
+  export GP_GIT_PROMPT="\\pr:\\pl:\\pc:\\pk"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then both should be the same
+  echo -e "Ref-only: $ref_only_output" >&2
+  echo -e "libgit2:  $output" >&2
+  [ "$ref_only_output" = "$output" ]
+}
+
+
+# --------------------------------------------------
+@test "upstream is found among many packed refs" {
+  # given we have a git repo
+  mkdir myRepo
+  cd myRepo
+  helper__new_repo_and_commit "newfile" "some text"
+  cd -
+
+  # given we clone it to anotherLocation/myRepo
+  mkdir anotherLocation
+  cd anotherLocation
+  git clone ../myRepo
+  cd myRepo
+  helper__set_git_config
+  cd ../..
+
+  # given we commit a change in the first repo
+  cd myRepo
+  echo "new text" > newfile
+  git add newfile
+  git commit -m 'update the file with "new text"'
+  cd -
+
+  # given we fetch, create lots of refs on both sides of
+  # refs/remotes/origin/main and pack them all
+  cd anotherLocation/myRepo
+  git fetch
+  oid=$(git rev-parse HEAD)
+  for i in $(seq 1 500); do
+    echo "create refs/remotes/aaa/branch-$i $oid"
+    echo "create refs/remotes/zzz/branch-$i $oid"
+  done | git update-ref --stdin
+  git pack-refs --all
+  [ ! -e .git/refs/remotes/origin/main ]
+
+  # when we run the prompt
+  export GP_GIT_PROMPT="REPO:\\pR:BEHIND:\\pb:"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the upstream ref should be found in packed-refs, and
+  # - the repo field should be MODIFIED and
+  # - behind is 1
+  expected_prompt="REPO:${MODIFIED}myRepo${RESET}:BEHIND:1:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+
+  evaluated_prompt=$(echo -e $expected_prompt)
+  [ "$output" =  "$evaluated_prompt" ]
+}
+
+
+# --------------------------------------------------
+@test "ref-only prompt reads a reftable stack" {
+  # given a repo whose refs are the ones in fixtures/reftable (see
+  # generate.sh there): main, featureBranch, 200 branches and 20 tags in
+  # several ref blocks plus an index block, then HEAD pointed at
+  # featureBranch, then branch-007 deleted
+  mkdir -p myRepo/.git/refs
+  cd myRepo
+  cp -r "$BATS_TEST_DIRNAME/fixtures/reftable" .git/reftable
+  rm .git/reftable/generate.sh
+  echo "ref: refs/heads/.invalid" > .git/HEAD
+
+  # given the stack has several tables, and the largest one has an index
+  # (a non-zero ref_index_position in its footer)
+  [ $(wc -l < .git/reftable/tables.list) -ge 2 ]
+  largest=$(ls -S .git/reftable/*.ref | head -1)
+  [ "$(tail -c 68 "$largest" | od -An -tu1 -j24 -N8 | tr -d ' \n')" != "00000000" ]
+
+  # when we run a prompt which only needs ref names
+  export GP_GIT_PROMPT="\\pr:\\pl"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then HEAD is read from the newer table
+  [ "$output" = "myRepo:featureBranch" ]
+
+  # given HEAD points at a branch which is only found through the index
+  # block of the older table (a HEAD file is read before the reftable)
+  echo "ref: refs/heads/branch-150" > .git/HEAD
+
+  # when we run the prompt again
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the branch is found
+  [ "$output" = "myRepo:branch-150" ]
+
+  # given HEAD points at the branch the newer table deleted
+  echo "ref: refs/heads/branch-007" > .git/HEAD
+
+  # when we run the prompt again
+  run -${EXIT_NO_LOCAL_REF} $GENERATE_PROMPT
+
+  # then the branch is unborn
+  [ "$output" = "\\W $ " ]
+
+  # when the newest table is left out of the stack
+  grep -v "$(tail -n 1 .git/reftable/tables.list)" .git/reftable/tables.list > tables.list
+  mv tables.list .git/reftable/tables.list
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the branch is back, so it was the newest table's deletion
+  # record which hid it
+  [ "$output" = "myRepo:branch-007" ]
+}
+
+
+# --------------------------------------------------
+@test "ref-only prompt reads refs from reftable" {
+  # given git can create reftable repositories (git 2.45 and later)
+  git init --ref-format=reftable --initial-branch=main probe || skip "git has no reftable support"
+
+  # given we have a reftable repo with a commit on a branch
+  mkdir myRepo
+  cd myRepo
+  git init --ref-format=reftable --initial-branch=main
+  helper__set_git_config
+  echo "some text" > newfile
+  git add newfile
+  git commit -m 'Initial commit'
+  git checkout -b featureBranch
+
+  # when we run a prompt which only needs ref names
+  export GP_GIT_PROMPT="\\pr:\\pl"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then HEAD and the branch are read from the reftable stack
+  [ "$output" = "myRepo:featureBranch" ]
+}
+
+
+# --------------------------------------------------
+@test "divergence from upstream, push destination and mainline" {
+  # given a project with a commit on main
+  mkdir project
+  cd project
+  helper__new_repo_and_commit "newfile" "some text"
+  cd -
+
+  # given a fork of it with a commit on a feature branch
+  git clone project fork
+  cd fork
+  helper__set_git_config
+  git checkout -b feature
+  echo "fork" > forkfile
+  git add forkfile
+  git commit -m 'fork commit'
+  cd -
+
+  # given the project gets three more commits
+  cd project
+  for i in 1 2 3; do
+    echo "$i" > newfile
+    git commit -a -m "project commit $i"
+  done
+  cd -
+
+  # given we clone the fork, fetch the project as 'upstream', track
+  # upstream/main and commit twice on the feature branch
+  git clone fork local
+  cd local
+  helper__set_git_config
+  git remote add upstream ../project
+  git fetch upstream
+  git checkout feature
+  git branch -u upstream/main
+  for i in 1 2; do
+    echo "$i" > localfile
+    git add localfile
+    git commit -m "local commit $i"
+  done
+
+  # when we push to origin and compare with origin/main as mainline
+  git config remote.pushDefault origin
+  export GP_MAINLINE_REF=refs/remotes/origin/main
+  export GP_GIT_PROMPT="U:\\pu:W:\\pw:M:\\pm:D:\\pd:"
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then each instruction counts against its own ref
+  expected_prompt="U:(3,-3):W:(2,-0):M:(3,-0):D:(2,-0):"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$expected_prompt" ]
+
+  # when the mainline is the default and push.default is nothing
+  unset GP_MAINLINE_REF
+  git config push.default nothing
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then \pm compares with upstream/main and \pw is empty
+  expected_prompt="U:(3,-3):W::M:(3,-3):D:(2,-0):"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$expected_prompt" ]
+
+  # when the mainline ref doesn't exist
+  export GP_MAINLINE_REF=refs/remotes/upstream/nope
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then \pm is empty
+  expected_prompt="U:(3,-3):W::M::D:(2,-0):"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$expected_prompt" ]
+
+  # then the concurrent prompt matches the serial one
+  helper__assert_same_as_serial
+}
+
+@test "concurrent status and divergence give the same prompt as serial" {
+  # given we have a git repo
+  mkdir myRepo
+  cd myRepo
+  helper__new_repo_and_commit "newfile" "some text"
+  cd -
+
+  # given we clone it to a new location
+  mkdir tmp
+  cd tmp
+  git clone ../myRepo
+  cd myRepo
+  helper__set_git_config
+
+  # then a freshly cloned repo gives the same prompt
+  helper__assert_same_as_serial
+
+  # given we diverge from upstream and have both staged and unstaged
+  # changes
+  cd ../../myRepo
+  echo "new text" > newfile
+  git commit -a -m 'update the file with "new text"'
+  cd -
+  echo "different message" > newfile
+  git commit -a -m 'update the file with "different message"'
+  git fetch
+  echo "staged" > stagedfile
+  git add stagedfile
+  echo "unstaged" >> stagedfile
+
+  # then the prompt is still the same
+  helper__assert_same_as_serial
+
+  # given we get a conflict
+  git stash
+  git pull || true
+
+  # then the prompt is still the same
+  helper__assert_same_as_serial
+}
+
+
+# --------------------------------------------------
+@test "an index in blocks for multi-threaded readers gives the same prompt" {
+  # given we have a git repo with enough files for git to split its
+  # index into blocks, and which uses index v4
+  helper__new_repo_and_commit "newfile" "some text"
+  for d in $(seq 1 20); do
+    mkdir dir$d
+    for f in $(seq 1 1000); do echo "some text" > dir$d/$f; done
+  done
+  git add .
+  git commit -m "add many files"
+  git config index.version 4
+  git config index.threads 2
+  git update-index --index-version 4 --force-write-index
+  grep -q IEOT .git/index
+  export GP_GIT_PROMPT="LOCALBRANCH:\\pL:WD:\\pC:"
+  l_branch=$(cat .git/HEAD | tr '/' ' ' | cut -d\   -f 4)
+  wd=$(basename $PWD)
+
+  # when nothing has changed
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then everything is up to date
+  expected_prompt="LOCALBRANCH:${UP_TO_DATE}${l_branch}${RESET}:WD:${UP_TO_DATE}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+
+  # when files in the first and last blocks are touched, and the prompt
+  # refreshes the index
+  touch -d "2001-01-01" dir1/1 dir9/999
+  GP_REFRESH_INDEX=1 run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then their stat data is written back, and the index is still v4
+  # with its offset table
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+  [ -z "$(git diff-files --name-only)" ]
+  [ $(od -An -tu1 -j7 -N1 .git/index) -eq 4 ]
+  grep -q IEOT .git/index
+
+  # when a file in the last block changes
+  echo "changed" > dir9/999
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the working directory is modified
+  expected_prompt="LOCALBRANCH:${UP_TO_DATE}${l_branch}${RESET}:WD:${MODIFIED}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+
+  # when the change is staged
+  git add dir9/999
+  grep -q IEOT .git/index
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then only the branch is modified
+  expected_prompt="LOCALBRANCH:${MODIFIED}${l_branch}${RESET}:WD:${UP_TO_DATE}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+
+  # when it is committed, and a new file is only marked as to be added
+  git commit -m "change a file"
+  echo "new" > dir9/new
+  git add -N dir9/new
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then both are modified
+  expected_prompt="LOCALBRANCH:${MODIFIED}${l_branch}${RESET}:WD:${MODIFIED}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+}
+
+
+@test "staged and unstaged states are found in a tree with many changes" {
+  # given we have a git repo with many tracked files
+  helper__new_repo_and_commit "newfile" "some text"
+  for i in $(seq 1 200); do echo "text" > "file$i"; done
+  git add .
+  git commit -m "add many files"
+  export GP_GIT_PROMPT="LOCALBRANCH:\\pL:WD:\\pC:"
+  l_branch=$(cat .git/HEAD | tr '/' ' ' | cut -d\   -f 4)
+  wd=$(basename $PWD)
+
+  # when only the index has changes
+  for i in $(seq 1 100); do echo "staged" > "file$i"; done
+  git add .
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then only the branch is modified
+  expected_prompt="LOCALBRANCH:${MODIFIED}${l_branch}${RESET}:WD:${UP_TO_DATE}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+
+  # when the changes are committed and files are deleted and changed
+  # in the working directory only
+  git commit -m "stage and commit"
+  rm file1 file2
+  for i in $(seq 150 200); do echo "unstaged" > "file$i"; done
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then only the working directory is modified
+  expected_prompt="LOCALBRANCH:${UP_TO_DATE}${l_branch}${RESET}:WD:${MODIFIED}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+
+  # when a file is also renamed in the index
+  git mv file3 renamed
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then both are modified
+  expected_prompt="LOCALBRANCH:${MODIFIED}${l_branch}${RESET}:WD:${MODIFIED}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+}
+
+
+# --------------------------------------------------
+@test "simultaneous prompts in the same repo give the same prompt" {
+  # given we have a cloned repo which is behind upstream and has
+  # unstaged changes
+  mkdir myRepo
+  cd myRepo
+  helper__new_repo_and_commit "newfile" "some text"
+  cd -
+  mkdir tmp
+  cd tmp
+  git clone ../myRepo
+  cd myRepo
+  helper__set_git_config
+  cd ../../myRepo
+  echo "new text" > newfile
+  git commit -a -m 'update the file with "new text"'
+  cd -
+  git fetch
+  echo "unstaged" >> newfile
+  export GP_GIT_PROMPT="R:\\pR:L:\\pL:C:\\pC:K:\\pK:d:\\pd"
+  expected_output=$(GP_SINGLE_FLIGHT_WAIT_MS=0 $GENERATE_PROMPT)
+
+  # when several prompts are drawn at the same time
+  for i in 1 2 3 4 5 6; do
+    $GENERATE_PROMPT > "output$i" &
+  done
+  wait
+
+  # then they all give the same prompt as one on its own
+  for i in 1 2 3 4 5 6; do
+    echo -e "Expected: $expected_output" >&2
+    echo -e "Output:   $(cat output$i)" >&2
+    [ "$(cat output$i)" = "$expected_output" ]
+  done
+}
+
+
+# --------------------------------------------------
+@test "a prompt reuses the result of a concurrent prompt" {
+  # given we have a git repo with a result published for a waiting
+  # prompt
+  helper__new_repo_and_commit "newfile" "some text"
+  export GP_GIT_PROMPT="LOCALBRANCH:\\pL:AHEAD:\\pa:"
+  flock .git/generate-prompt.lock sleep 0.2 &
+  sleep 0.1
+  GP_SINGLE_FLIGHT_WAIT_MS=5000 $GENERATE_PROMPT
+  wait
+  l_branch=$(cat .git/HEAD | tr '/' ' ' | cut -d\  -f 4)
+
+  # given another prompt holds the lock and then publishes a newer
+  # result, in which the branch is 7 commits ahead
+  awk '{ $1 = $1 + 1; $11 = 7; print }' .git/generate-prompt.result > newer.result
+  flock .git/generate-prompt.lock sh -c 'sleep 0.3; mv newer.result .git/generate-prompt.result' &
+  sleep 0.1
+
+  # when we run the prompt
+  GP_SINGLE_FLIGHT_WAIT_MS=5000 run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+  wait
+
+  # then it shows the published result instead of computing its own
+  expected_prompt="LOCALBRANCH:${UP_TO_DATE}${l_branch}${RESET}:AHEAD:7:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+}
+
+
+# --------------------------------------------------
+@test "a prompt drawn on its own publishes nothing" {
+  # given we have a git repo with unstaged changes
+  helper__new_repo_and_commit "newfile" "some text"
+  echo "unstaged" >> newfile
+
+  # when we run the prompt without any other prompt waiting
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then no result file is written into the git directory
+  [ ! -e .git/generate-prompt.result ]
+  [ ! -s .git/generate-prompt.lock ]
+}
+
+
+# --------------------------------------------------
+@test "a held or abandoned lock does not break the prompt" {
+  # given we have a git repo with unstaged changes
+  helper__new_repo_and_commit "newfile" "some text"
+  echo "unstaged" >> newfile
+  expected_output=$(GP_SINGLE_FLIGHT_WAIT_MS=0 $GENERATE_PROMPT)
+
+  # when another process holds the lock for longer than we wait
+  ( exec 9> .git/generate-prompt.lock; flock 9; exec sleep 5 ) &
+  holder=$!
+  sleep 0.1
+  GP_SINGLE_FLIGHT_WAIT_MS=50 run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then we compute the prompt ourselves
+  echo -e "Expected: $expected_output" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$expected_output" ]
+
+  # when the process holding the lock is killed
+  kill -9 $holder
+  wait $holder || true
+  GP_SINGLE_FLIGHT_WAIT_MS=5000 run -${EXIT_GIT_PROMPT} timeout 1 $GENERATE_PROMPT
+
+  # then the lock is free again without waiting, and the prompt is
+  # unchanged
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$expected_output" ]
+}
+
+
+# --------------------------------------------------
+@test "--explain-cost attributes stat'ed, hashed and ignored entries" {
+  # given we have a git repo with a directory of tracked files
+  helper__new_repo_and_commit "newfile" "some text"
+  mkdir src
+  echo "one" > src/one
+  echo "two" > src/two
+  git add src
+  git commit -m "add src"
+
+  # given one file has stale stat data and there are untracked files
+  touch -d "2001-01-01" src/one
+  mkdir build
+  echo "output" > build/output
+
+  # when we ask for the cost report as JSON
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT --explain-cost=json
+  echo "$output" >&2
+
+  # then it times the prompt's own pass, where the index is parsed
+  # natively and the stale file is hashed in src, and counts the
+  # untracked directory as one ignore-rule evaluation in build
+  echo "$output" | grep -q '"phases_ms": {.*"parse": [0-9.]*, .*"hash": [0-9.]*,'
+  echo "$output" | grep -q '"name": "src", .*"stat": 3, "hashed_files": 1, "hashed_bytes": 4,'
+  echo "$output" | grep -q '"name": "build", .*"ignore_checks": 1,'
+  echo "$output" | grep -q '"stat_changed_entries": 1,'
+  echo "$output" | grep -q '"index_blocks": 1}'
+  echo "$output" | grep -q "git update-index --refresh"
+
+  # when we ask for the table
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT --explain-cost
+  echo "$output" >&2
+
+  # then it has the same numbers
+  echo "$output" | grep -q "^  src  *[0-9.]*  *3  *1  *4 B  *0  *0$"
+  echo "$output" | grep -q "^  files stat'ed  *[0-9]"
+  echo "$output" | grep -q "^  index blocks parsed  *1$"
+
+  # when the prompt has to fall back to libgit2's diff
+  git config core.fileMode false
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT --explain-cost=json
+  echo "$output" >&2
+
+  # then the hashing is estimated instead, and the counts are the same
+  echo "$output" | grep -q '"name": "src", .*"stat": 3, "hashed_files": 1, "hashed_bytes": 4,'
+  echo "$output" | grep -q '"name": "build", .*"ignore_checks": 1,'
+}
+
+
+# --------------------------------------------------
+@test "--explain-cost counts submodules the native check leaves to libgit2" {
+  # given we have a git repo with a submodule and a file with stale stat
+  # data
+  helper__new_repo_and_commit "newfile" "some text"
+  mkdir sub
+  git update-index --add --cacheinfo 160000,$(git rev-parse HEAD),sub
+  git commit -m "add a submodule"
+  touch -d "2001-01-01" newfile
+
+  # when we ask for the cost report
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT --explain-cost=json
+  echo "$output" >&2
+
+  # then the submodule is counted and gets its hint, although the
+  # native check hashed newfile before it gave up on the submodule
+  echo "$output" | grep -q '"name": ".", .*"submodules": 1}'
+  echo "$output" | grep -q "submodule.<name>.ignore"
+  echo "$output" | grep -q '"hashed_files": 1, "hashed_bytes": 10,'
+}
+
+
+# --------------------------------------------------
+@test "--explain-cost counts rename candidates over all staged changes" {
+  # given we have a git repo with five committed files
+  helper__new_repo_and_commit "newfile" "some text"
+  for i in 1 2 3 4 5; do echo "old $i" > "old$i"; done
+  git add .
+  git commit -m "add old files"
+
+  # given three new files and two deletions are staged
+  for i in 1 2 3; do echo "new $i" > "new$i"; done
+  git add new1 new2 new3
+  git rm -q old1 old2
+
+  # when we ask for the cost report
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT --explain-cost=json
+  echo "$output" >&2
+
+  # then every add is paired with every delete, although the prompt's
+  # own pass stops at the first change
+  echo "$output" | grep -q '"rename_candidate_pairs": 6,'
+}
+
+
+# --------------------------------------------------
+@test "--explain-cost outside a git repository fails like the prompt" {
+  # given we are not in a git repository
+  # when we ask for the cost report
+  run -${EXIT_DEFAULT_PROMPT} $GENERATE_PROMPT --explain-cost
+
+  # then nothing is reported on stdout
+  [ -z "$output" ]
+}
+
+
+# --------------------------------------------------
+@test "touched files are hashed and the index is refreshed on request" {
+  # given we have a git repo with a file, a symlink and a large file
+  helper__new_repo_and_commit "newfile" "some text"
+  ln -s newfile link
+  head -c 1000000 /dev/zero > large
+  git add link large
+  git commit -m "add link and large file"
+  export GP_GIT_PROMPT="WD:\\pC:"
+  wd=$(basename $PWD)
+
+  # given their stat data no longer matches the index
+  touch -d "2001-01-01" newfile large
+  touch -h -d "2001-01-01" link
+  [ -n "$(git diff-files --name-only)" ]
+
+  # when we run the prompt
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the working directory is up to date, and the index on disk is
+  # left alone
+  expected_prompt="WD:${UP_TO_DATE}${wd}${RESET}:"
+  echo -e "Expected: $expected_prompt" >&2
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+  [ -n "$(git diff-files --name-only)" ]
+
+  # when we run the prompt with GP_REFRESH_INDEX, in a repo using the
+  # untracked cache
+  git config core.untrackedCache true
+  git update-index --untracked-cache
+  git status > /dev/null
+  grep -q UNTR .git/index
+  touch -d "2001-01-01" newfile large
+  GP_REFRESH_INDEX=1 run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the refreshed stat data is written back, and git's extensions
+  # are kept
+  [ "$output" = "$(echo -e $expected_prompt)" ]
+  [ -z "$(git diff-files --name-only)" ]
+  grep -q UNTR .git/index
+}
+
+
+# --------------------------------------------------
+@test "changes which keep the file size are found" {
+  # given we have a git repo
+  helper__new_repo_and_commit "newfile" "some text"
+  export GP_GIT_PROMPT="WD:\\pC:"
+  wd=$(basename $PWD)
+  modified_prompt="WD:${MODIFIED}${wd}${RESET}:"
+  up_to_date_prompt="WD:${UP_TO_DATE}${wd}${RESET}:"
+
+  # when a file changes but keeps its size
+  echo "some TEXT" > newfile
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the working directory is modified, also once the index has
+  # been refreshed
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $modified_prompt)" ]
+  GP_REFRESH_INDEX=1 run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+  [ "$output" = "$(echo -e $modified_prompt)" ]
+  [ -n "$(git status --porcelain)" ]
+
+  # when it only changes mode
+  git checkout newfile
+  chmod +x newfile
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the working directory is modified
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $modified_prompt)" ]
+
+  # when a file whose line endings are converted on the way into the
+  # repo is touched
+  chmod -x newfile
+  git config core.autocrlf true
+  printf 'crlf text\r\n' > crlffile
+  git add crlffile
+  git commit -m "add a file with CRLF line endings"
+  touch -d "2001-01-01" crlffile
+  run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then only the converted content counts
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $up_to_date_prompt)" ]
+
+  # when a file whose bytes are still the committed ones gets a clean
+  # filter which changes them, and is touched
+  git config core.autocrlf false
+  printf 'v $Id: 1234 $\n' > identfile
+  git add identfile
+  git commit -m "add a file with an expanded ident"
+  echo "identfile ident" > .git/info/attributes
+  touch -d "2001-01-01" identfile
+  GP_REFRESH_INDEX=1 run -${EXIT_GIT_PROMPT} $GENERATE_PROMPT
+
+  # then the filtered content counts, and the stat data isn't refreshed
+  echo -e "Output:   $output" >&2
+  [ "$output" = "$(echo -e $modified_prompt)" ]
+  [ -n "$(git diff-files --name-only identfile)" ]
+}
+
+
 # --------------------------------------------------
 @test "wd style: cwd inside of \$HOME" {
   # will write later